@@ -307,8 +307,8 @@ int main(int argc, char** argv)
 		//Resize
 		local.resize(local_pos);
 
-		//Sample randomly
-		TextureRemoval::sampleDataset(local, sample_select[i], MAX_SAMPLES);
+		//Sample randomly, each piece from its own random stream
+		TextureRemoval::sampleDataset(local, sample_select[i], MAX_SAMPLES, i);
 	}
 
 	//Drop global selection of coefficients to save memory
@@ -345,7 +345,7 @@ int main(int argc, char** argv)
 			}
 
 			//Train the model
-			model = TextureRemoval::gibbsSampling(sample_select[mod_sel], ncdata);
+			model = TextureRemoval::gibbsSampling(sample_select[mod_sel], ncdata, TextureRemoval::STORE_INFERENCE, mod_sel);
 
 			//Use this to store samples
 			std::vector<std::vector<float>> clusters(N * M / PSN / PSM * 2);
@@ -16,6 +16,7 @@
 
 #include <opencv2/opencv.hpp>
 #include <vector>
+#include <cstdint>
 
 
 /**
@@ -38,13 +39,31 @@ namespace CradleFunctions{
 	const int VERTICAL_DIR = 2;
 	const int CROSS_DIR = 3;
 
-	//Structure used to store cradled/non-cradled pixel pairs
+	//Validity bits of the cradled/non-cradled samples at a position of a cradle piece
+	const int SAMPLE_NCU = 1;
+	const int SAMPLE_CU = 2;
+	const int SAMPLE_NCL = 4;
+	const int SAMPLE_CL = 8;
+
+	//Structure used to store cradled/non-cradled pixel pairs of a cradle piece, as columns indexed by the
+	//position along the piece. The segments of the piece are disjoint spans of these columns
 	struct cradle_sample_pairs{
-		int start, end;					//Start/end indices of samples
 		std::vector<float> ncu;			//Non-cradled upper part
 		std::vector<float> cu;			//Cradled upper part
 		std::vector<float> ncl;			//Non-cradled lower part
 		std::vector<float> cl;			//Cradled lower part
+		std::vector<uchar> valid;		//Validity bits (SAMPLE_*) of the samples at each position
+	};
+
+	//Span of a cradle segment in the sample columns of its piece
+	struct sample_span{
+		int start, end;					//Start/end indices of samples
+	};
+
+	//Robust statistics of a sample vector, where -1 marks a missing sample
+	struct SampleStats{
+		bool valid;						//True if there is at least one valid sample
+		float median;					//Median of the valid samples, as returned by getMedian (-1 if none)
 	};
 
 	//Marks individual cradle segments in a mask & their central location.
@@ -59,6 +78,27 @@ namespace CradleFunctions{
 		std::vector<cv::Point2i> piece_middle;		//Middle coordinate of each cradle segment (needed by the Platypus interface)
 	};
 
+	//State of a streaming cradle detection, fed with image strips in top to bottom order
+	struct DetectionStream{
+		int L;								//Half-width of the gradient boxes
+		int cols;							//Image width
+		int rows;							//Number of rows received so far
+		int next;							//Next row whose vertical gradient projection is computed
+		cv::Mat vsum;						//Column projection of the horizontal gradient (CV_32F, 1 x cols)
+		std::vector<float> hsum;			//Row projection of the vertical gradient, rows [0, next)
+		std::vector<double> prefix;			//Prefix sums of the current row, padded by L replicated pixels on both sides
+		std::vector<double> up, down;		//Column sums of rows [next-L, next-1] and [next, next+L-1]
+		cv::Mat ring;						//Last 2L+1 image rows received (CV_32F)
+		cv::Mat mring;						//Last 2L+1 mask rows received
+	};
+
+	//Binary image storing one bit per pixel, each row padded to whole 64-bit words
+	struct BitMask{
+		int rows, cols;						//Image size
+		int stride;							//Number of words per row
+		std::vector<std::uint64_t> bits;	//Row-major words, bit j % 64 of word j / 64 is column j
+	};
+
 	//Callback functions for the interface
 	struct Callbacks
 	{
@@ -131,8 +171,26 @@ namespace CradleFunctions{
 		std::vector<int> &hrange		//Position of vertical cradle pieces, in pairs of 2: (Y_start1, Y_end1,..,Y_startM, Y_endM)
 	);
 
+	//Column (vsum) and row (hsum) projections of the horizontal and vertical gradients used for detection, skipping DEFECT pixels
+	//Gradients are differences of two L wide boxes (replicated borders); no gradient image is created
+	void projectionProfiles(const cv::Mat &in, const cv::Mat &mask, int L, cv::Mat &vsum, cv::Mat &hsum);
+
+	//Guided/blind cradle detection from the projections returned by projectionProfiles()
+	void detectFromProfiles(const cv::Mat &vsum, const cv::Mat &hsum, int vn, int hn, std::vector<int> &vrange, std::vector<int> &hrange);
+	void detectFromProfiles(const cv::Mat &vsum, const cv::Mat &hsum, std::vector<int> &vrange, std::vector<int> &hrange);
+
+	//Streaming cradle detection: create the stream for an image of 'cols' columns, add strips of rows
+	//(with the corresponding mask rows) as they are decoded, and get the result once the last strip was added
+	DetectionStream createDetectionStream(int cols, int L = 20);
+	void addStrip(DetectionStream &ds, const cv::Mat &strip, const cv::Mat &mask_strip);
+	void finishProfiles(DetectionStream &ds, cv::Mat &vsum, cv::Mat &hsum);
+	void finishDetection(DetectionStream &ds, int vn, int hn, std::vector<int> &vrange, std::vector<int> &hrange);
+	void finishDetection(DetectionStream &ds, std::vector<int> &vrange, std::vector<int> &hrange);
+
 	//Functions used for estimating rotation angle of horizontal/vertical cradle pieces
 	std::vector<double> findRadonTransformAngle(const cv::Mat &img, cv::Mat &mask, std::vector<double> &thetav, int sx, int ex, int sy, int ey, int noflag);
+	//Same as above, also returning the projection of the best angle, equal to getRadonforAngle() at that angle (ready for getEdges())
+	std::vector<double> findRadonTransformAngle(const cv::Mat &img, cv::Mat &mask, std::vector<double> &thetav, int sx, int ex, int sy, int ey, int noflag, cv::Mat &projection);
 	cv::Mat getRadonforAngle(cv::Mat &d, cv::Mat &mask, double theta, int sx, int ex, int sy, int ey, int noflag);
 	std::vector<float> getEdges(cv::Mat &R, double angle, int type, int s);
 	cv::Mat get_edgeshape(const cv::Mat &r, int side, double h, double l, int usecdf);
@@ -146,6 +204,8 @@ namespace CradleFunctions{
 	void createMaskVertical(cv::Mat &mask, std::vector<int> &vrange, int s);
 	void removeMaskVertical(cv::Mat &mask, std::vector<int> &vrange, int s);
 	void removeEdgeArtifact(const cv::Mat &img, cv::Mat &cradle, int dir, int stx, int enx, int sty, int eny);
+	BitMask createBitMask(int rows, int cols);
+	int floodFillBelow(const cv::Mat &val, float th, int i, int j, BitMask &mark);
 	cv::Mat flipVertical(cv::Mat &in);
 	float max(cv::Mat &m);
 	float min(cv::Mat &m);
@@ -0,0 +1,59 @@
+/*
+* Copyright (c) 2016, Gabor Adam Fodor <fogggab@yahoo.com>
+* All rights reserved.
+*
+* License:
+*
+* This program is provided for scientific and educational purposed only.
+* Feel free to use and/or modify it for such purposes, but you are kindly
+* asked not to redistribute this or derivative works in source or executable
+* form. A license must be obtained from the author of the code for any other use.
+*
+*/
+
+#ifndef CRADLEINTERVALS_H
+#define CRADLEINTERVALS_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+/**
+* Interval representation of the cradle mask (V_MASK, H_MASK, DEFECT flags) and of the piece map
+* (MarkedSegments::piece_mask). Every row keeps the sorted, disjoint runs of pixels that have a flag
+* or a piece ID, so a row with k runs takes O(k) memory and a point query is a binary search, O(log k).
+* Texture removal reads the mask and piece map through it instead of padded image copies, and the
+* MarkedSegments files store the piece map as its runs.
+**/
+
+namespace CradleIntervals{
+
+	//Run of pixels of a row sharing the same mask flags and piece ID
+	struct Run{
+		int start, end;					//Columns [start, end) of the run
+		uchar flags;					//Mask flags of the pixels
+		ushort id;						//Piece ID of the pixels (0 outside cradle pieces)
+	};
+
+	//Runs of every row of an image; pixels outside the runs have no flags and piece ID 0
+	struct Intervals{
+		int rows, cols;					//Image size
+		std::vector<std::vector<Run>> row;	//Sorted, disjoint runs of each row
+	};
+
+	//Empty intervals of an image of the given size
+	Intervals create(int rows, int cols);
+
+	//Encode a mask (CV_8U) and/or a piece map (CV_16U); either may be empty, otherwise they have the same size
+	Intervals encode(const cv::Mat &mask, const cv::Mat &piece_mask);
+
+	//Run containing pixel (y, x), NULL if the pixel has no flags and piece ID 0
+	const Run *find(const Intervals &iv, int y, int x);
+
+	//Append a run to row y, after its last run
+	void append(Intervals &iv, int y, int x0, int x1, uchar flags, ushort id);
+
+	//Rasterize the piece map (CV_16U)
+	void rasterizePieces(const Intervals &iv, cv::Mat &piece_mask);
+}
+
+#endif
@@ -0,0 +1,61 @@
+/*
+* Copyright (c) 2016, Gabor Adam Fodor <fogggab@yahoo.com>
+* All rights reserved.
+*
+* License:
+*
+* This program is provided for scientific and educational purposed only.
+* Feel free to use and/or modify it for such purposes, but you are kindly
+* asked not to redistribute this or derivative works in source or executable
+* form. A license must be obtained from the author of the code for any other use.
+*
+*/
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+/**
+* Counter-based random number generation (Philox4x32-10, Salmon et al., "Parallel random numbers:
+* as easy as 1, 2, 3", SC 2011).
+* A random stream is addressed by a key (seed, piece) and a counter (iteration, site, row), its values
+* do not depend on which thread consumes it or in which order streams are created. This keeps all
+* random draws reproducible once the work using them is parallelized.
+**/
+
+namespace Random{
+
+	//State of a random stream
+	struct Stream{
+		uint32_t key[2];	//Seed and piece index
+		uint32_t ctr[4];	//Iteration, site, row and block index within the stream
+		uint32_t buf[4];	//Current block of random words
+		int pos;			//Next unused word in buf
+		bool has_spare;		//Second value of the last Box-Muller pair is still unused
+		float spare;		//Unused Box-Muller value
+	};
+
+	//Create the stream addressed by (seed, piece) and (iter, site, row)
+	Stream stream(uint32_t seed, uint32_t piece, uint32_t iter, uint32_t site, uint32_t row);
+
+	//Philox4x32-10 block function, encrypts counter 'ctr' with 'key' into 'out'
+	void philox(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]);
+
+	//Next random 32-bit word of the stream
+	uint32_t next(Stream &s);
+
+	//Uniform sample from the open interval (0,1)
+	double uniform(Stream &s);
+
+	//Uniform integer sample from [0,n)
+	int uniformInt(Stream &s, int n);
+
+	//Normal sample with given mean and standard deviation (Box-Muller)
+	float normal(Stream &s, float mean, float sd);
+
+	//Gamma sample with given shape and scale (Marsaglia-Tsang), same parametrization as std::gamma_distribution
+	float gamma(Stream &s, float shape, float scale);
+}
+
+#endif
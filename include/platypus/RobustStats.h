@@ -0,0 +1,53 @@
+/*
+* Copyright (c) 2016, Gabor Adam Fodor <fogggab@yahoo.com>
+* All rights reserved.
+*
+* License:
+*
+* This program is provided for scientific and educational purposed only.
+* Feel free to use and/or modify it for such purposes, but you are kindly
+* asked not to redistribute this or derivative works in source or executable
+* form. A license must be obtained from the author of the code for any other use.
+*
+*/
+
+#ifndef ROBUSTSTATS_H
+#define ROBUSTSTATS_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+/**
+* Robust statistics used by cradle removal. Medians and trimmed moments are found by selection
+* (introselect, std::nth_element) instead of sorting, in linear expected time. Image moments are
+* computed in a single pass over contiguous rows, merging per-row moments (Chan et al.) so that
+* the inner loops vectorize without losing the stability of Welford's update.
+* The vector functions ignore samples equal to MISSING, the marker used by the cradle sampling code.
+**/
+
+namespace RobustStats{
+
+	const float MISSING = -1;	//Marker of a missing sample
+
+	//Copy the samples of v that are not MISSING into out, returns their number
+	int validSamples(const std::vector<float> &v, std::vector<float> &out);
+
+	//k-th smallest value of v (0-based), reorders v
+	float select(std::vector<float> &v, int k);
+
+	//Median of v as defined by CradleFunctions::getMedian: the upper middle sample for even sizes, the
+	//mean of the middle and the next sample for odd sizes above one; MISSING if v is empty. Reorders v
+	float median(std::vector<float> &v);
+
+	//Mean and variance of the middle half of v (sorted positions [n/4, n - n/4)) using two selections,
+	//both MISSING if v is empty. Reorders v
+	void trimmedMoments(std::vector<float> &v, float &mean, float &var);
+
+	//Mean of a single channel float image
+	double mean(const cv::Mat &m);
+
+	//Mean and population variance of a single channel float image in one pass
+	void meanVariance(const cv::Mat &m, double &mean, double &var);
+}
+
+#endif
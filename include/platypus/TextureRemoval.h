@@ -12,8 +12,11 @@
 */
 
 #include <platypus/CradleFunctions.h>
+#include <platypus/Random.h>
 #include <opencv2/opencv.hpp>
+#include <opencv2/flann.hpp>
 #include <vector>
+#include <memory>
 
 /**
 * Collection of all functions that make texture separation, and in particular, wood grain removal possible.
@@ -26,6 +29,14 @@ namespace TextureRemoval{
 	const int VERTICAL = 0;
 	const int HORIZONTAL = 1;
 
+	//Model storage policies for gibbsSampling()
+	const int STORE_INFERENCE = 0;	//Keep only the parameters used by post_inference() (Lambda, Gamma, ps, rho, kappa)
+	const int STORE_FULL = 1;		//Additionally keep the latent factors (xi, eta_c, eta_nc) of every retained draw
+
+	//Nearest-neighbour search methods
+	const int NN_KDTREE = 0;		//Approximate search in a randomized kd-tree forest (FLANN)
+	const int NN_BRUTEFORCE = 1;	//Exact brute-force search (vectorized batch distance)
+
 	//Structure representing all the parameters of the wood-grain statistical model
 	//A detailed explanation of what each variable stands for is given in the IPOL article
 	struct cradle_model_fitting{
@@ -39,7 +50,29 @@ namespace TextureRemoval{
 		std::vector<cv::Mat> etanc_v;
 	};
 
-	cradle_model_fitting gibbsSampling(std::vector<std::vector<float>> &cradle, std::vector<std::vector<float>> &noncradle);
+	//Uniform random selection of at most 'capacity' samples from a stream of samples (reservoir sampling)
+	struct SampleReservoir{
+		std::vector<std::vector<float>> samples;	//Selected samples
+		int capacity;								//Maximum number of samples kept
+		int dim;									//Size of a sample
+		int seen;									//Number of samples offered so far
+		Random::Stream rs;							//Random stream deciding replacements
+	};
+
+	//Nearest-neighbour look-up structure over the codebook of a trained model
+	struct NeighbourIndex{
+		cv::Mat codebook;													//Codebook points, one per row
+		int method;															//NN_KDTREE or NN_BRUTEFORCE
+		std::unique_ptr< cv::flann::GenericIndex< cvflann::L2<float> > > kdTree;	//Search tree, only used by NN_KDTREE
+	};
+
+	//Train the wood-grain model on cradle/non-cradle samples
+	cradle_model_fitting gibbsSampling(
+		std::vector<std::vector<float>> &cradle,		//Normalized cradle coefficients
+		std::vector<std::vector<float>> &noncradle,		//Normalized non-cradle coefficients
+		int storage = STORE_INFERENCE,					//STORE_INFERENCE or STORE_FULL; latent factors are only kept with STORE_FULL
+		int piece = 0									//Index of the piece, selects the random streams used for training
+	);
 	
 	//Function responsible for separation
 	void post_inference(
@@ -58,7 +91,21 @@ namespace TextureRemoval{
 	);
 
 	//Take 'cnt' samples, selected randomly from 'dts' and returned in 'samples' 
-	void sampleDataset(std::vector<std::vector<float>> &dts, std::vector<std::vector<float>> &samples, int cnt);
+	//The random stream used is selected by 'piece', so the selection is reproducible for each piece
+	void sampleDataset(std::vector<std::vector<float>> &dts, std::vector<std::vector<float>> &samples, int cnt, int piece = 0);
+
+	//Create an empty reservoir for samples of size 'dim', using the random stream of 'piece'
+	SampleReservoir createReservoir(int capacity, int dim, int piece);
+
+	//Offer the next sample to the reservoir
+	//Returns the storage the sample has to be written to, or NULL if the sample is not selected
+	std::vector<float> *reserveSample(SampleReservoir &r);
+
+	//Build the nearest-neighbour index of a codebook (CV_32F, one point per row)
+	void buildNeighbourIndex(NeighbourIndex &index, cv::Mat &codebook, int method);
+
+	//Find the 'k' nearest codebook points of each row of 'queries', returning their indices and squared distances
+	void knnSearch(NeighbourIndex &index, cv::Mat &queries, cv::Mat &indices, cv::Mat &distances, int k);
 
 	//Reconstruct image block between points (sx,sy) (ex,ey) with a local shift of (csx,csy)
 	void reconstructBlock(cv::Mat &texture, std::vector<cv::Mat> &coeffs, int sx, int sy, int csx, int csy, int cex, int cey);
@@ -13,7 +13,13 @@
 
 #include <platypus/CradleFunctions.h>
 #include <platypus/TextureRemoval.h>
+#include <platypus/RobustStats.h>
+#include <platypus/CradleIntervals.h>
 #include <fstream>
+#include <cstring>
+#include <queue>
+#include <map>
+#include <algorithm>
 
 /**
 * Collection of all functions that make cradle removal possible.
@@ -105,6 +111,80 @@ namespace CradleFunctions{
 		out = in - cradle;
 	}
 
+	//Same response as filtering with the {1,..,1,-1,..,-1} row kernel of length 2L (replicated borders), computed with
+	//running box sums instead of a 2L tap convolution
+	static cv::Mat horizontalGradient(const cv::Mat &img, int L){
+		int N = img.rows, M = img.cols;
+		cv::Mat grad(N, M, CV_32F);
+		std::vector<double> prefix(M + 2 * L + 1);
+		for (int i = 0; i < N; i++){
+			const float *row = img.ptr<float>(i);
+			float *g = grad.ptr<float>(i);
+
+			//Sum of the L pixels on the left minus sum of the L pixels on the right (starting at j)
+			prefix[0] = 0;
+			for (int j = 0; j < M + 2 * L; j++){
+				prefix[j + 1] = prefix[j] + row[std::min(std::max(j - L, 0), M - 1)];
+			}
+			for (int j = 0; j < M; j++){
+				g[j] = (float)((prefix[j + L] - prefix[j]) - (prefix[j + 2 * L] - prefix[j + L]));
+			}
+		}
+		return grad;
+	}
+
+	//Same response as filtering with the {1,..,1,-1,..,-1}' column kernel of length 2L (replicated borders)
+	static cv::Mat verticalGradient(const cv::Mat &img, int L){
+		int N = img.rows, M = img.cols;
+		cv::Mat grad(N, M, CV_32F);
+		if (N == 0){
+			return grad;
+		}
+
+		//Column sums of rows [i-L, i-1] (up) and [i, i+L-1] (down), slid one row down per output row
+		std::vector<double> up(M), down(M, 0);
+		const float *top = img.ptr<float>(0);
+		for (int j = 0; j < M; j++){
+			up[j] = L * (double)top[j];
+		}
+		for (int k = 0; k < L; k++){
+			const float *row = img.ptr<float>(std::min(k, N - 1));
+			for (int j = 0; j < M; j++){
+				down[j] += row[j];
+			}
+		}
+		for (int i = 0; i < N; i++){
+			float *g = grad.ptr<float>(i);
+			for (int j = 0; j < M; j++){
+				g[j] = (float)(up[j] - down[j]);
+			}
+
+			const float *rcur = img.ptr<float>(i);
+			const float *rout = img.ptr<float>(std::max(i - L, 0));
+			const float *rin = img.ptr<float>(std::min(i + L, N - 1));
+			for (int j = 0; j < M; j++){
+				up[j] += rcur[j] - rout[j];
+				down[j] += rin[j] - rcur[j];
+			}
+		}
+		return grad;
+	}
+
+	//Offset k in [-s, s] (in increments of step) maximizing cost(k), -s if no cost is positive
+	template <class CostFunction>
+	static int searchEdgeOffset(int s, int step, CostFunction cost){
+		int best = -s;
+		double bestc = 0;
+		for (int k = -s; k <= s; k += step){
+			float c = cost(k);
+			if (c > bestc){
+				bestc = c;
+				best = k;
+			}
+		}
+		return best;
+	}
+
 	//Mark horizontal cradle pieces in the mask image
 	std::vector<std::vector<int>> markHorizontalCradle(
 		const cv::Mat &img,			// Input image
@@ -114,14 +194,8 @@ namespace CradleFunctions{
 		// If set to -1, this value is determined on the fly by the code
 		){
 		//Grad filtering
-		cv::Mat grad;
 		int L = 20;
-
-		cv::Mat hkern(2 * L, 1, CV_32F, 1);				//{-1, -1, -1, .. 1, 1, 1, 1}'
-		for (int i = L; i < 2 * L; i++){
-			hkern.at<float>(i, 0) = -1;
-		}
-		cv::filter2D(img, grad, CV_32F, hkern, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
+		cv::Mat grad = verticalGradient(img, L);
 
 		//Initialize angles
 		std::vector<double> theta;
@@ -162,7 +236,6 @@ namespace CradleFunctions{
 			int step = std::max(1, s / 40);
 			std::vector<double> radon;
 			float angle1, angle2;
-			float bestc;
 			int stk, enk;
 
 			if (vrange[i * 2] != 0){
@@ -170,9 +243,7 @@ namespace CradleFunctions{
 				angle1 = radon[0] * M_PI / 180;
 
 				//Find best position for cradle edge
-				stk = -s;
-				float bestc = 0;
-				for (int k = -s; k <= s; k += step){
+				stk = searchEdgeOffset(s, step, [&](int k){
 					float cost = 0;
 					for (int j = 0; j < img.cols; j++){
 						int py = vrange[2 * i] + j * std::cos(angle1) + k;
@@ -185,11 +256,8 @@ namespace CradleFunctions{
 							}
 						}
 					}
-					if (cost > bestc){
-						bestc = cost;
-						stk = k;
-					}
-				}
+					return cost;
+				});
 			}
 			else{
 				//Marked segment is right along the edge - take 90 degree angle and fix position
@@ -214,9 +282,7 @@ namespace CradleFunctions{
 				angle2 = radon[0] * M_PI / 180;
 
 				//Find best position for cradle edge
-				enk = -s;
-				bestc = 0;
-				for (int k = -s; k <= s; k += step){
+				enk = searchEdgeOffset(s, step, [&](int k){
 					float cost = 0;
 					for (int j = 0; j < img.cols; j++){
 						int py = vrange[2 * i + 1] + j * std::cos(angle2) + k;
@@ -229,11 +295,8 @@ namespace CradleFunctions{
 							}
 						}
 					}
-					if (cost > bestc){
-						bestc = cost;
-						enk = k;
-					}
-				}
+					return cost;
+				});
 			}
 			else{
 				//Marked segment is right along the edge - take 90 degree angle and fix position
@@ -282,14 +345,8 @@ namespace CradleFunctions{
 		// If set to -1, this value is determined on the fly by the code
 		){
 		//Filter image horizontal/vertical
-		cv::Mat grad;
 		int L = 20;
-
-		cv::Mat vkern(1, 2 * L, CV_32F, 1);				//{-1, -1, -1, .. 1, 1, 1, 1}
-		for (int i = L; i < 2 * L; i++){
-			vkern.at<float>(0, i) = -1;
-		}
-		cv::filter2D(img, grad, CV_32F, vkern, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
+		cv::Mat grad = horizontalGradient(img, L);
 
 		//Initialize angles
 		std::vector<double> theta;
@@ -330,7 +387,7 @@ namespace CradleFunctions{
 			int step = std::max(1, s / 40);
 
 			std::vector<double> radon;
-			double angle1, angle2, bestc;
+			double angle1, angle2;
 			int stk, enk;
 
 			if (vrange[i * 2] != 0){
@@ -338,9 +395,7 @@ namespace CradleFunctions{
 				angle1 = radon[0] * M_PI / 180;
 
 				//Find best position for cradle edge
-				stk = -s;
-				bestc = 0;
-				for (int k = -s; k <= s; k += step){
+				stk = searchEdgeOffset(s, step, [&](int k){
 					float cost = 0;
 					for (int j = 0; j < img.rows; j++){
 						int py = vrange[2 * i] + j * std::sin(angle1) + k;
@@ -353,11 +408,8 @@ namespace CradleFunctions{
 							}
 						}
 					}
-					if (cost > bestc){
-						bestc = cost;
-						stk = k;
-					}
-				}
+					return cost;
+				});
 			}
 			else{
 				//Marked segment is right along the edge - take 90 degree angle and fix position
@@ -380,9 +432,7 @@ namespace CradleFunctions{
 				angle2 = radon[0] * M_PI / 180;
 
 				//Find best position for cradle edge
-				enk = -s;
-				bestc = 0;
-				for (int k = -s; k <= s; k += step){
+				enk = searchEdgeOffset(s, step, [&](int k){
 					float cost = 0;
 					for (int j = 0; j < img.rows; j++){
 						int py = vrange[2 * i + 1] + j * std::sin(angle2) + k;
@@ -395,11 +445,8 @@ namespace CradleFunctions{
 							}
 						}
 					}
-					if (cost > bestc){
-						bestc = cost;
-						enk = k;
-					}
-				}
+					return cost;
+				});
 			}
 			else{
 				//Marked segment is right along the edge - take 90 degree angle and fix position
@@ -437,6 +484,432 @@ namespace CradleFunctions{
 		return res;
 	}
 
+	//Allocate the sample columns of a cradle piece of length n, with no valid samples
+	static cradle_sample_pairs createSamplePairs(int n){
+		cradle_sample_pairs sp;
+		sp.ncu = std::vector<float>(n);
+		sp.cu = std::vector<float>(n);
+		sp.ncl = std::vector<float>(n);
+		sp.cl = std::vector<float>(n);
+		sp.valid = std::vector<uchar>(n, 0);
+		return sp;
+	}
+
+	//Get validity and median of compacted samples (reorders them)
+	static SampleStats compactStats(std::vector<float> &mv){
+		SampleStats st;
+		st.valid = !mv.empty();
+		st.median = RobustStats::median(mv);
+		return st;
+	}
+
+	//Linear regression on compacted pairs, see linearFitting
+	static std::vector<float> linearFit(const float *x, const float *y, int n){
+		float mx, my, mxy, mxx;
+		mx = my = mxx = mxy = 0;
+
+		for (int i = 0; i < n; i++){
+			mx += x[i];
+			my += y[i];
+		}
+		mx /= n;
+		my /= n;
+
+		for (int i = 0; i < n; i++){
+			mxy += (x[i] - mx)*(y[i] - my);
+			mxx += (x[i] - mx)*(x[i] - mx);
+		}
+		std::vector<float> res(2);
+
+		res[1] = mxy / mxx;
+		res[0] = my - res[1] * mx;
+		return res;
+	}
+
+	//Statistics of the valid samples of a column within a segment, compacted into 'work'
+	static SampleStats spanStats(const cradle_sample_pairs &sp, const std::vector<float> &col, int bit, const sample_span &span, std::vector<float> &work){
+		work.clear();
+		for (int j = span.start; j <= span.end; j++){
+			if (sp.valid[j] & bit)
+				work.push_back(col[j]);
+		}
+		return compactStats(work);
+	}
+
+	//Linear fit y = A + B*x on the pairs of a segment where both samples are valid, compacted into 'wx', 'wy'
+	static std::vector<float> spanFitting(const cradle_sample_pairs &sp, const std::vector<float> &x, const std::vector<float> &y, int bits, const sample_span &span, std::vector<float> &wx, std::vector<float> &wy){
+		wx.clear();
+		wy.clear();
+		for (int j = span.start; j <= span.end; j++){
+			if ((sp.valid[j] & bits) == bits){
+				wx.push_back(x[j]);
+				wy.push_back(y[j]);
+			}
+		}
+		return linearFit(wx.data(), wy.data(), wx.size());
+	}
+
+	//Pixels of an image row (column) labeled with the same segment of a piece
+	struct LabelRun{
+		int line;								//Row (column) of the run
+		int start, end;							//First and last column (row) of the run
+		int segment;							//Index of the segment in the piece
+	};
+
+	//Segments found while processing one cradle piece (or cross-section), kept aside until the piece is committed
+	struct PieceSegments{
+		std::vector<cv::Point2i> middle;		//Middle point of each segment
+		std::vector<LabelRun> runs;				//Labeled pixels, in the order they were written
+		bool columns;							//Runs lie along image columns instead of rows
+	};
+
+	//Append a segment to the piece and return its index in the piece
+	static inline int addSegment(PieceSegments &segs, cv::Point2i middle){
+		segs.middle.push_back(middle);
+		return (int)segs.middle.size() - 1;
+	}
+
+	//Label pixel 'pos' of row (column) 'line' with segment 'id' of the piece, growing the last run when it is adjacent
+	static inline void addLabel(PieceSegments &segs, int line, int pos, int id){
+		if (!segs.runs.empty()){
+			LabelRun &r = segs.runs.back();
+			if (r.line == line && r.segment == id && pos >= r.start - 1 && pos <= r.end + 1){
+				r.start = std::min(r.start, pos);
+				r.end = std::max(r.end, pos);
+				return;
+			}
+		}
+		LabelRun r = { line, pos, pos, id };
+		segs.runs.push_back(r);
+	}
+
+	//Register the segments of a piece in MarkedSegments; returns the final ID of its first segment
+	static int commitSegments(MarkedSegments &ms, const PieceSegments &segs, int type, std::vector<int> *idh, std::vector<int> *idv){
+		int first = ms.pieces + 1;
+		for (int k = 0; k < segs.middle.size(); k++){
+			ms.pieces++;
+			ms.piece_type.push_back(type);
+			ms.piece_middle.push_back(segs.middle[k]);
+			if (idh)
+				idh->push_back(ms.pieces);
+			if (idv)
+				idv->push_back(ms.pieces);
+		}
+		return first;
+	}
+
+	//Number of pieces processed by a removal pass: pieces are processed up to the first one whose middle line is
+	//given by two points in the same column/row (a degenerate line), as when processing them one by one
+	static int validPieces(const std::vector<std::vector<int>> &midpos_points){
+		int n = 0;
+		while (n < midpos_points.size() && midpos_points[n][0] != midpos_points[n][2])
+			n++;
+		return n;
+	}
+
+	//Process the n pieces of one removal pass in parallel. Pieces of a pass cover disjoint parts of the image, but
+	//segment IDs depend on the processing order, so each piece records its labeled pixels as runs of piece-local segment
+	//indices, and the pieces are committed and written to the piece mask in order afterwards, giving the same IDs and
+	//piece mask as processing them one by one.
+	//After an abort, pieces not started yet are skipped; every piece that finished (possibly one after the aborted one,
+	//on another thread) is committed, so the piece mask covers all corrections written to the cradle
+	template <typename Piece, typename Commit>
+	static void removePieces(int n, MarkedSegments &ms, Piece piece, Commit commit){
+		std::vector<PieceSegments> segs(n);
+		std::vector<char> done(n, 0);
+		bool stop = false;
+		int completed = 0;
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < n; i++){
+			bool halt;
+			#pragma omp atomic read
+			halt = stop;
+			if (halt)
+				continue;
+
+			// progress/abort (number of pieces finished so far)
+			bool go;
+			#pragma omp critical(cradle_progress)
+			{
+				int c;
+				#pragma omp atomic read
+				c = completed;
+				go = progress(c, n);
+			}
+
+			segs[i].columns = false;
+			if (!go || !piece(i, segs[i])){
+				#pragma omp atomic write
+				stop = true;
+				continue;
+			}
+			done[i] = 1;
+
+			#pragma omp atomic
+			completed++;
+		}
+
+		//Commit finished pieces in order and label their pixels with the final segment IDs
+		for (int i = 0; i < n; i++){
+			if (!done[i])
+				continue;
+			int first = commit(i, segs[i]);
+			for (const LabelRun &r : segs[i].runs){
+				ushort id = first + r.segment;
+				if (segs[i].columns){
+					for (int y = r.start; y <= r.end; y++){
+						ms.piece_mask.at<ushort>(y, r.line) = id;
+					}
+				}
+				else{
+					ushort *pp = ms.piece_mask.ptr<ushort>(r.line);
+					for (int x = r.start; x <= r.end; x++){
+						pp[x] = id;
+					}
+				}
+			}
+		}
+	}
+
+	//Finds the crossing of the middle lines of a horizontal and a vertical piece, i.e. the last row k with
+	//midposh[midposv[k]] == k, given the two points (column, row) of each line. Away from the real crossing k*
+	//the rounded lines drift apart by |1 - mh * mv| rows per row (mh, mv being their slopes), so only rows
+	//closer to k* than (2 + |mh|) / |1 - mh * mv| can match; returns false if there is no such row
+	static bool crossingPoint(const std::vector<int> &midposh, const std::vector<int> &midposv, const std::vector<int> &ph, const std::vector<int> &pv, int &msx, int &msy){
+		int rows = midposv.size();
+		int k0 = 0, k1 = rows;
+		double mh = (float)((ph[3] - ph[1]) * 1.0 / (ph[2] - ph[0]));
+		double mv = (float)((pv[3] - pv[1]) * 1.0 / (pv[2] - pv[0]));
+		double det = 1 - mh * mv;
+		if (std::abs(det) > 0.25){
+			double kc = (ph[1] + mh * (pv[1] - mv * pv[0] - ph[0])) / det;
+			double r = (2 + std::abs(mh)) / std::abs(det) + 2;
+			k0 = (int)std::max(0.0, std::floor(kc - r));
+			k1 = (int)std::min((double)rows, std::ceil(kc + r) + 1);
+		}
+
+		//Nearly parallel lines fall back to checking all rows
+		for (int k = k1 - 1; k >= k0; k--){
+			int c = midposv[k];
+			if (c >= 0 && c < midposh.size() && midposh[c] == k){
+				msx = k;
+				msy = c;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	//True if a pixel of row r in columns [c0, c1) is part of both a horizontal and a vertical cradle piece
+	static inline bool rowCrossed(const cv::Mat &mask, int r, int c0, int c1){
+		const uchar *mp = mask.ptr<uchar>(r);
+		for (int c = c0; c < c1; c++){
+			if ((mp[c] & (H_MASK | V_MASK)) == (H_MASK | V_MASK))
+				return true;
+		}
+		return false;
+	}
+
+	//True if a pixel of column c in rows [r0, r1) is part of both a horizontal and a vertical cradle piece
+	static inline bool colCrossed(const cv::Mat &mask, int c, int r0, int r1){
+		for (int r = r0; r < r1; r++){
+			if ((mask.ptr<uchar>(r)[c] & (H_MASK | V_MASK)) == (H_MASK | V_MASK))
+				return true;
+		}
+		return false;
+	}
+
+	//Remove the cross-section of horizontal piece i and vertical piece j, its segments and labeled pixels are recorded in 'segs'
+	static void removeCrossSectionPiece(
+		int i,												//Index of the horizontal cradle piece
+		int j,												//Index of the vertical cradle piece
+		const cv::Mat &img,									//Input grayscale float X-ray image
+		const cv::Mat &filtered,							//Smoothed input image
+		cv::Mat &mask,										//Mask containing marked horizontal and/or vertical cradle positions
+		cv::Mat &cradle,									//Cradle component after separation saved out here
+		std::vector<int> &hrange,							//Width of horizontal cradle pieces
+		std::vector<int> &vrange,							//Width of vertical cradle pieces
+		std::vector<std::vector<int>> &midposh,				//Middle line of horizontal cradle pieces
+		std::vector<std::vector<int>> &midposv,				//Middle line of vertical cradle pieces
+		std::vector<std::vector<int>> &midposh_points,		//Center of horizontal cradle pieces
+		std::vector<std::vector<int>> &midposv_points,		//Center of vertical cradle pieces
+		std::vector<std::vector<std::vector<float>>> &hm,	//Parameters of the fitted multiplicative model for horizontal cradle pieces
+		std::vector<std::vector<std::vector<float>>> &vm,	//Parameters of the fitted multiplicative model for vertical cradle pieces
+		PieceSegments &segs									//Segments of the cross-section
+	){
+		//Find pixels considered to be part of cross section
+		int sx, sy, msx, msy;
+		if (!crossingPoint(midposh[i], midposv[j], midposh_points[i], midposv_points[j], msx, msy))
+			return;
+
+		//New segment, marked at its middle
+		int id = addSegment(segs, cv::Point2i(msx, msy));
+
+		sx = msx;
+		sy = msy;
+
+		int widthv = vrange[j];
+		int widthh = hrange[i];
+		int sv = std::max((int)(widthv * 0.03), 2);
+		int sh = std::max((int)(widthh * 0.03), 2);
+
+		int minh = std::max(sx - widthh / 2 - sh, 0);
+		int maxh = std::min(sx + widthh / 2 + sh, img.rows);
+		int minv = std::max(sy - widthv / 2 - sv, 0);
+		int maxv = std::min(sy + widthv / 2 + sv, img.cols);
+
+		//Middle of previously identified cradle intersections is marked by (H_MASK | V_MASK)
+		if ((mask.at<char>(sx, sy) & (H_MASK | V_MASK)) == (H_MASK | V_MASK)){
+			int stx, enx, sty, eny;
+
+			//Search upwards
+			stx = sx - 1;
+			while (stx != -1 && rowCrossed(mask, stx, minv, maxv))
+				stx--;
+
+			//Search downwards
+			enx = sx + 1;
+			while (enx != img.rows && rowCrossed(mask, enx, minv, maxv))
+				enx++;
+
+			//Search leftwards
+			sty = sy - 1;
+			while (sty != -1 && colCrossed(mask, sty, minh, maxh))
+				sty--;
+
+			//Search rightwards
+			eny = sy + 1;
+			while (eny != img.cols && colCrossed(mask, eny, minh, maxh))
+				eny++;
+
+			stx = std::max(0, stx);
+			enx = std::min(img.rows - 1, enx);
+			sty = std::max(0, sty);
+			eny = std::min(img.cols - 1, eny);
+
+			int prev = -1;
+			for (int k = 0; k < vm[j].size(); k++){
+				if (vm[j][k][4] < msx)
+					prev = k;
+			}
+			int postv = -1;
+			for (int k = vm[j].size() - 1; k >= 0; k--){
+				if (vm[j][k][4] > msx)
+					postv = k;
+			}
+			int preh = -1;
+			for (int k = 0; k < hm[i].size(); k++){
+				if (hm[i][k][4] < msy)
+					preh = k;
+			}
+			int posth = -1;
+			for (int k = hm[i].size() - 1; k >= 0; k--){
+				if (hm[i][k][4] > msy)
+					posth = k;
+			}
+
+			//Remove cradle part
+			for (int k = stx; k <= enx; k++){
+				for (int l = sty; l <= eny; l++){
+					if (cradle.at<float>(k, l) == 0 && ((mask.at<char>(k, l) & DEFECT) == 0)){
+
+						float val = filtered.at<float>(k, l);
+
+						float c1h, c1v, c2h, c2v, c3h, c3v, c4h, c4v;
+						float chpre, chpost, cvpre, cvpost;
+						float whpre, whpost, wvpre, wvpost;
+
+						if (preh != -1){
+							c1h = hm[i][preh][1] * val + hm[i][preh][0];
+							c4h = hm[i][preh][3] * val + hm[i][preh][2];
+							whpre = 1.0 / (1 + 1.0*(l - sty));
+
+							//Take weighted average of approximations
+							chpre = (k - stx) * 1.0 / (enx - stx)*(c4h - c1h) + c1h;
+
+							if (chpre != chpre){
+								chpre = 0;
+								whpre = 0;
+							}
+						}
+						else{
+							chpre = 0;
+							whpre = 0;
+						}
+
+						if (posth != -1){
+							c2h = hm[i][posth][1] * val + hm[i][posth][0];
+							c3h = hm[i][posth][3] * val + hm[i][posth][2];
+							whpost = 1.0 / (1 + 1.0*(eny - l));
+
+							//Take weighted average of approximations
+							chpost = (k - stx) * 1.0 / (enx - stx)*(c3h - c2h) + c2h;
+
+							if (chpost != chpost){
+								chpost = 0;
+								whpost = 0;
+							}
+						}
+						else{
+							chpost = 0;
+							whpost = 0;
+						}
+
+						if (prev != -1){
+							c1v = vm[j][prev][1] * val + vm[j][prev][0];
+							c2v = vm[j][prev][3] * val + vm[j][prev][2];
+							wvpre = 1.0 / (1 + 1.0*(k - stx));
+
+							//Take weighted average of approximations
+							cvpre = (l - sty) * 1.0 / (eny - sty)*(c2v - c1v) + c1v;
+
+							if (cvpre != cvpre){
+								cvpre = 0;
+								wvpre = 0;
+							}
+
+						}
+						else{
+							cvpre = 0;
+							wvpre = 0;
+						}
+						if (postv != -1){
+							c3v = vm[j][postv][1] * val + vm[j][postv][0];
+							c4v = vm[j][postv][3] * val + vm[j][postv][2];
+							wvpost = 1.0 / (1 + 1.0*(enx - k));
+
+							//Take weighted average of approximations
+							cvpost = (l - sty) * 1.0 / (eny - sty)*(c4v - c3v) + c3v;
+
+							if (cvpost != cvpost){
+								cvpost = 0;
+								wvpost = 0;
+							}
+						}
+						else{
+							cvpost = 0;
+							wvpost = 0;
+						}
+
+						addLabel(segs, k, l, id);
+						cradle.at<float>(k, l) = filtered.at<float>(k, l) - (whpre*chpre + whpost*chpost + wvpre*cvpre + wvpost*cvpost) *1.0 / (whpre + whpost + wvpre + wvpost);
+					}
+				}
+			}
+
+
+			//Clean up black lines
+			int hwidth = (enx - stx) * 0.1;
+			int vwidth = (eny - sty) * 0.1;
+
+			removeEdgeArtifact(img, cradle, TextureRemoval::HORIZONTAL, stx - hwidth, stx + hwidth, sty, eny);
+			removeEdgeArtifact(img, cradle, TextureRemoval::HORIZONTAL, enx - hwidth, enx + hwidth, sty, eny);
+			removeEdgeArtifact(img, cradle, TextureRemoval::VERTICAL, stx, enx, sty - vwidth, sty + vwidth);
+			removeEdgeArtifact(img, cradle, TextureRemoval::VERTICAL, stx, enx, eny - vwidth, eny + vwidth);
+		}
+	}
+
 	//Remove cradle from cross-sections
 	void removeCrossSection(
 		const cv::Mat &img,									//Input grayscale float X-ray image
@@ -459,6 +932,7 @@ namespace CradleFunctions{
 		cv::filter2D(img, filtered, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
 
 		//Do a checkup to make sure there is no invalid cradle pixel i the image
+		#pragma omp parallel for
 		for (int i = 0; i < cradle.rows; i++){
 			for (int j = 0; j < cradle.cols; j++){
 				if (cradle.at<float>(i, j) != cradle.at<float>(i, j)){
@@ -520,861 +994,591 @@ namespace CradleFunctions{
 		}
 
 		//Cover all cross section cradles
-		for (int j = 0; j < vrange.size(); j++){
-			for (int i = 0; i < hrange.size(); i++){
-
-				// progress/abort
-				if (!progress(j * vrange.size() + i, vrange.size() * hrange.size()))
-					return;
-
-				//Find pixels considered to be part of cross section
-				int sx, sy, msx, msy;
-				for (int k = 0; k < midposv[j].size(); k++){
-					if (midposh[i][midposv[j][k]] == k){
-						msy = midposv[j][k];
-						msx = k;
-					}
-				}
-
-				//Increase number of pieces
-				ms.pieces++;
-				ms.piece_type.push_back(CROSS_DIR);
-				ms.pieceIDh[i].push_back(ms.pieces);
-				ms.pieceIDv[j].push_back(ms.pieces);
-
-				//Mark middle
-				ms.piece_middle.push_back(cv::Point2i(msx, msy));
-
-				sx = msx;
-				sy = msy;
-
-				int widthv = vrange[j];
-				int widthh = hrange[i];
-				int sv = std::max((int)(widthv * 0.03), 2);
-				int sh = std::max((int)(widthh * 0.03), 2);
-
-				int minh = std::max(sx - widthh / 2 - sh, 0);
-				int maxh = std::min(sx + widthh / 2 + sh, img.rows);
-				int minv = std::max(sy - widthv / 2 - sv, 0);
-				int maxv = std::min(sy + widthv / 2 + sv, img.cols);
-
-				//Middle of previously identified cradle intersections is marked by (H_MASK | V_MASK)
-				if ((mask.at<char>(sx, sy) & (H_MASK | V_MASK)) == (H_MASK | V_MASK)){
-					int stx, enx, sty, eny, ok;
-
-					//Search upwards
-					stx = sx - 1;
-					ok = 0;
-					while (ok == 0){
-						ok = 1;
-						if (stx != -1){
-							for (int k = minv; k < maxv; k++){
-								if ((mask.at<char>(stx, k) & (H_MASK | V_MASK)) == (H_MASK | V_MASK)){
-									ok = 0;
-									stx--;
-									break;
-								}
-							}
-						}
-					}
-
-					//Search downwards
-					enx = sx + 1;
-					ok = 0;
-					while (ok == 0){
-						ok = 1;
-						if (enx != img.rows){
-							for (int k = minv; k < maxv; k++){
-								if ((mask.at<char>(enx, k)  & (H_MASK | V_MASK)) == (H_MASK | V_MASK)){
-									ok = 0;
-									enx++;
-									break;
-								}
-							}
-						}
-					}
-
-					//Search leftwards
-					sty = sy - 1;
-					ok = 0;
-					while (ok == 0){
-						ok = 1;
-						if (sty != -1){
-							for (int k = minh; k < maxh; k++){
-								if ((mask.at<char>(k, sty) & (H_MASK | V_MASK)) == (H_MASK | V_MASK)){
-									ok = 0;
-									sty--;
-									break;
-								}
-							}
-						}
-					}
-
-					//Search rightwards
-					eny = sy + 1;
-					ok = 0;
-					while (ok == 0){
-						ok = 1;
-						if (eny != img.cols){
-							for (int k = minh; k < maxh; k++){
-								if ((mask.at<char>(k, eny) & (H_MASK | V_MASK)) == (H_MASK | V_MASK)){
-									ok = 0;
-									eny++;
-									break;
-								}
-							}
-						}
-					}
-
-					stx = std::max(0, stx);
-					enx = std::min(img.rows - 1, enx);
-					sty = std::max(0, sty);
-					eny = std::min(img.cols - 1, eny);
-
-					int prev = -1;
-					for (int k = 0; k < vm[j].size(); k++){
-						if (vm[j][k][4] < msx)
-							prev = k;
-					}
-					int postv = -1;
-					for (int k = vm[j].size() - 1; k >= 0; k--){
-						if (vm[j][k][4] > msx)
-							postv = k;
-					}
-					int preh = -1;
-					for (int k = 0; k < hm[i].size(); k++){
-						if (hm[i][k][4] < msy)
-							preh = k;
-					}
-					int posth = -1;
-					for (int k = hm[i].size() - 1; k >= 0; k--){
-						if (hm[i][k][4] > msy)
-							posth = k;
-					}
-
-					//Remove cradle part
-					for (int k = stx; k <= enx; k++){
-						for (int l = sty; l <= eny; l++){
-							if (cradle.at<float>(k, l) == 0 && ((mask.at<char>(k, l) & DEFECT) == 0)){
+		removePieces(vtot * htot, ms, [&](int t, PieceSegments &segs){
+			removeCrossSectionPiece(t % htot, t / htot, img, filtered, mask, cradle, hrange, vrange, midposh, midposv, midposh_points, midposv_points, hm, vm, segs);
+			return true;
+		}, [&](int t, const PieceSegments &segs){
+			return commitSegments(ms, segs, CROSS_DIR, &ms.pieceIDh[t % htot], &ms.pieceIDv[t / htot]);
+		});
+	}
 
-								float val = filtered.at<float>(k, l);
+	//Remove vertical cradle piece i, its segments and labeled pixels are recorded in 'segs'; returns false if its middle line is invalid
+	static bool removeVerticalPiece(
+		int i,												//Index of the vertical cradle piece
+		const cv::Mat &img,									//Input grayscale float X-ray image
+		const cv::Mat &filtered,							//Directionally smoothed input image
+		cv::Mat &mask,										//Mask containing marked vertical and/or horizontal cradle positions
+		cv::Mat &cradle,									//Cradle component after separation saved out here
+		std::vector<std::vector<int>> &midpos_points,		//Center of vertical cradle pieces
+		std::vector<int> &s,								//Width of vertical cradle pieces
+		std::vector<std::vector<float>> &vmi,				//Saves out parameters of the fitted multiplicative model of the piece
+		PieceSegments &segs									//Segments of the piece
+	){
+		//Set adaptively value of s
+		int sfm = s[i] * 0.1;
+
+		//Create midpos vector (interpolate two points for all columns)
+		std::vector<int> midpos(img.rows);
+		int x1 = midpos_points[i][0];
+		int y1 = midpos_points[i][1];
+		int x2 = midpos_points[i][2];
+		int y2 = midpos_points[i][3];
+
+		if (x2 == x1){
+			//This is a vertical line -> invalid for a horizontal cradle piece
+			return false; //Stuff went wrong
+		}
+		else{
+			float m = (y2 - y1) * 1.0 / (x2 - x1);
+			//Fill up midpoints
+			for (int j = 0; j < img.rows; j++){
+				midpos[j] = m * (j - x1) + y1;
+			}
+		}
 
-								float c1h, c1v, c2h, c2v, c3h, c3v, c4h, c4v;
-								float chpre, chpost, cvpre, cvpost;
-								float whpre, whpost, wvpre, wvpost;
+		int step = std::min(3, std::max(sfm / 5, 1));
 
-								if (preh != -1){
-									c1h = hm[i][preh][1] * val + hm[i][preh][0];
-									c4h = hm[i][preh][3] * val + hm[i][preh][2];
-									whpre = 1.0 / (1 + 1.0*(l - sty));
+		//Pairwise samples for fitting (upper and lower edges), each segment is a span of them
+		cradle_sample_pairs samples = createSamplePairs(img.rows);
+		std::vector<sample_span> segment_samples;
+		sample_span sample = {0, 0};
+		int segment_cnt = 0;
+		int segment_seek = 1;
 
-									//Take weighted average of approximations
-									chpre = (k - stx) * 1.0 / (enx - stx)*(c4h - c1h) + c1h;
+		//Window of the local medians next to the cradle edges, reused for all rows
+		std::vector<float> medi;
+		medi.reserve(sfm + 1);
 
-									if (chpre != chpre){
-										chpre = 0;
-										whpre = 0;
-									}
-								}
-								else{
-									chpre = 0;
-									whpre = 0;
-								}
+		//Sample cradle/noncradle pairs
+		for (int j = 0; j < img.rows; j++){
 
-								if (posth != -1){
-									c2h = hm[i][posth][1] * val + hm[i][posth][0];
-									c3h = hm[i][posth][3] * val + hm[i][posth][2];
-									whpost = 1.0 / (1 + 1.0*(eny - l));
+			//Find start/end of cradle part
+			int p1, p2;
+			p1 = p2 = midpos[j];
 
-									//Take weighted average of approximations
-									chpost = (k - stx) * 1.0 / (enx - stx)*(c3h - c2h) + c2h;
+			while (p1 > 0 && (mask.at<char>(j, p1) & V_MASK) == V_MASK)
+				p1--;
+			while (p2 < mask.cols - 1 && (mask.at<char>(j, p2) & V_MASK) == V_MASK)
+				p2++;
 
-									if (chpost != chpost){
-										chpost = 0;
-										whpost = 0;
-									}
-								}
-								else{
-									chpost = 0;
-									whpost = 0;
-								}
+			int start = std::max(0, p1 - sfm);
+			int end = std::min(img.cols - 1, p2 + sfm);
 
-								if (prev != -1){
-									c1v = vm[j][prev][1] * val + vm[j][prev][0];
-									c2v = vm[j][prev][3] * val + vm[j][prev][2];
-									wvpre = 1.0 / (1 + 1.0*(k - stx));
+			//Check if contains horizontal mask
+			int maskfound = 0;
+			for (int k = start; k <= end; k++){
+				if ((mask.at<char>(j, k) & H_MASK) != 0){
+					maskfound++;
+				}
+			}
 
-									//Take weighted average of approximations
-									cvpre = (l - sty) * 1.0 / (eny - sty)*(c2v - c1v) + c1v;
+			if (maskfound > 0){
+				//Mark as vertical cradle (for cross section later on)
+				for (int k = p1; k <= p2; k++){
+					mask.at<char>(j, k) |= V_MASK;
+				}
 
-									if (cvpre != cvpre){
-										cvpre = 0;
-										wvpre = 0;
-									}
+				if (segment_seek == 0){
+					//Vertical mask part reached
+					sample.end = j;
+					segment_samples.push_back(sample);
+					segment_cnt++;
+					segment_seek = 1;
+				}
+			}
+			else{
+				//The current column contains no vertical cradle part
+				//Initializ new segment
+				if (segment_seek == 1){
+					segment_seek = 0;
 
-								}
-								else{
-									cvpre = 0;
-									wvpre = 0;
-								}
-								if (postv != -1){
-									c3v = vm[j][postv][1] * val + vm[j][postv][0];
-									c4v = vm[j][postv][3] * val + vm[j][postv][2];
-									wvpost = 1.0 / (1 + 1.0*(enx - k));
-
-									//Take weighted average of approximations
-									cvpost = (l - sty) * 1.0 / (eny - sty)*(c4v - c3v) + c3v;
-
-									if (cvpost != cvpost){
-										cvpost = 0;
-										wvpost = 0;
-									}
-								}
-								else{
-									cvpost = 0;
-									wvpost = 0;
-								}
+					sample.start = j;
+					sample.end = -1;
+				}
 
-								ms.piece_mask.at<ushort>(k, l) = ms.pieces;
-								cradle.at<float>(k, l) = filtered.at<float>(k, l) - (whpre*chpre + whpost*chpost + wvpre*cvpre + wvpost*cvpost) *1.0 / (whpre + whpost + wvpre + wvpost);
-							}
+				if (p1 - 2 * sfm >= 0){
+					//Sample above cradle
+					medi.clear();
+					for (int z = std::max(0, p1 - 2 * sfm); z <= p1 - sfm; z++){
+						if ((mask.at<char>(j, z) & (H_MASK | DEFECT)) == 0){
+							medi.push_back(filtered.at<float>(j, z));
 						}
 					}
+					if (!medi.empty()){
+						samples.ncu[j] = RobustStats::median(medi);
+						samples.valid[j] |= SAMPLE_NCU;
+					}
 
+					if ((mask.at<char>(j, p1 + sfm) & (H_MASK | DEFECT)) == 0){
+						samples.cu[j] = filtered.at<float>(j, p1 + sfm);
+						samples.valid[j] |= SAMPLE_CU;
+					}
+				}
 
-					//Clean up black lines
-					int hwidth = (enx - stx) * 0.1;
-					int vwidth = (eny - sty) * 0.1;
+				if (p2 + 2 * sfm < mask.cols){
+					//Sample below cradle
+					medi.clear();
+					for (int z = p2 + sfm; z < std::min(p2 + 2 * sfm, filtered.cols); z++){
+						if ((mask.at<char>(j, z) & (H_MASK | DEFECT)) == 0){
+							medi.push_back(filtered.at<float>(j, z));
+						}
+					}
+					if (!medi.empty()){
+						samples.ncl[j] = RobustStats::median(medi);
+						samples.valid[j] |= SAMPLE_NCL;
+					}
 
-					removeEdgeArtifact(img, cradle, TextureRemoval::HORIZONTAL, stx - hwidth, stx + hwidth, sty, eny);
-					removeEdgeArtifact(img, cradle, TextureRemoval::HORIZONTAL, enx - hwidth, enx + hwidth, sty, eny);
-					removeEdgeArtifact(img, cradle, TextureRemoval::VERTICAL, stx, enx, sty - vwidth, sty + vwidth);
-					removeEdgeArtifact(img, cradle, TextureRemoval::VERTICAL, stx, enx, eny - vwidth, eny + vwidth);
+					if ((mask.at<char>(j, p2 - sfm) & (H_MASK | DEFECT)) == 0){
+						samples.cl[j] = filtered.at<float>(j, p2 - sfm);
+						samples.valid[j] |= SAMPLE_CL;
+					}
 				}
-
 			}
 		}
-	}
 
-	//Remove vertical cradle pieces and save out correction model used for later usage
-	void removeVertical(
-		const cv::Mat &img,									//Input grayscale float X-ray image
-		cv::Mat &mask,										//Mask containing marked vertical and/or horizontal cradle positions
-		cv::Mat &cradle,									//Cradle component after separation saved out here
-		std::vector<std::vector<int>> &midpos_points,		//Center of vertical cradle pieces
-		std::vector<int> s,									//Width of vertical cradle pieces
-		std::vector<std::vector<std::vector<float>>> &vm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
-		MarkedSegments &ms									//MarkedSegment structure will contain processing information
-	){
-		//Set avg_s as a function of the average cradle-piece thickness
-		float avg = 0;
-		int avg_s;
-		for (int i = 0; i < s.size(); i++){
-			avg += s[i];
+		//Add end to the last segment part
+		if (sample.end == -1){
+			//Vertical mask part reached
+			sample.end = img.rows - 1;
+			segment_samples.push_back(sample);
+			segment_cnt++;
 		}
-		avg /= s.size();
-		avg_s = std::max(3, (int)(avg * 0.2));
 
-		//Directional smoothing of image
-		cv::Mat smooth, filtered;
-		smooth = cv::Mat(avg_s, 1, CV_32F, cv::Scalar(1.0 / avg_s));
-		cv::filter2D(img, filtered, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
+		vmi = std::vector<std::vector<float>>(segment_cnt);
 
-		int vtot = midpos_points.size();	//Total number of vertical pieces
-		std::vector<std::vector<int>> midpos(vtot);
-		vm = std::vector<std::vector<std::vector<float>>>(vtot);
+		//Scratch buffers for the compacted valid samples of a segment
+		std::vector<float> wx, wy;
 
-		//Cover all vertical cradles
-		for (int i = 0; i < vtot; i++){
-			// progress/abort
-			if (!progress(i, vtot))
-				return;
+		//Fit model on each segment
+		for (int s = 0; s < segment_cnt; s++){
 
-			//Set adaptively value of s
-			int sfm = s[i] * 0.1;
+			sample = segment_samples[s];
 
-			//Create midpos vector (interpolate two points for all columns)
-			midpos[i] = std::vector<int>(img.rows);
-			int x1 = midpos_points[i][0];
-			int y1 = midpos_points[i][1];
-			int x2 = midpos_points[i][2];
-			int y2 = midpos_points[i][3];
+			//New segment, marked at its middle
+			int id = addSegment(segs, cv::Point2i((sample.end + sample.start) / 2, midpos[(sample.end + sample.start) / 2]));
 
-			if (x2 == x1){
-				//This is a vertical line -> invalid for a horizontal cradle piece
-				return; //Stuff went wrong
+			std::vector<float> lin_model_midu(2), lin_model_midl(2);
+
+			//Robust statistics of the sampled profiles, shared by the model checks below
+			SampleStats ncu = spanStats(samples, samples.ncu, SAMPLE_NCU, sample, wx), cu = spanStats(samples, samples.cu, SAMPLE_CU, sample, wx);
+			SampleStats ncl = spanStats(samples, samples.ncl, SAMPLE_NCL, sample, wx), cl = spanStats(samples, samples.cl, SAMPLE_CL, sample, wx);
+
+			lin_model_midu = spanFitting(samples, samples.cu, samples.ncu, SAMPLE_CU | SAMPLE_NCU, sample, wx, wy);
+			if (ncl.valid){
+				lin_model_midl = spanFitting(samples, samples.cl, samples.ncl, SAMPLE_CL | SAMPLE_NCL, sample, wx, wy);
 			}
 			else{
-				float m = (y2 - y1) * 1.0 / (x2 - x1);
-				//Fill up midpoints
-				for (int j = 0; j < img.rows; j++){
-					midpos[i][j] = m * (j - x1) + y1;
-				}
+				lin_model_midl[0] = lin_model_midu[0];
+				lin_model_midl[1] = lin_model_midu[1];
+			}
+			if (!ncu.valid){
+				lin_model_midu[0] = lin_model_midl[0];
+				lin_model_midu[1] = lin_model_midl[1];
 			}
 
-			int step = std::min(3, std::max(sfm / 5, 1));
-
-			//Pairwise samples for fitting (upper and lower edges)
-			std::vector<cradle_sample_pairs> segment_samples(100);
-			cradle_sample_pairs sample = segment_samples[0];
-			int segment_cnt = 0;
-			int segment_seek = 1;
-
-			//Sample cradle/noncradle pairs
-			for (int j = 0; j < img.rows; j++){
-
-				//Find start/end of cradle part
-				int p1, p2;
-				p1 = p2 = midpos[i][j];
-
-				while (p1 > 0 && (mask.at<char>(j, p1) & V_MASK) == V_MASK)
-					p1--;
-				while (p2 < mask.cols - 1 && (mask.at<char>(j, p2) & V_MASK) == V_MASK)
-					p2++;
-
-				int start = std::max(0, p1 - sfm);
-				int end = std::min(img.cols - 1, p2 + sfm);
-
-				//Check if contains horizontal mask
-				int maskfound = 0;
-				for (int k = start; k <= end; k++){
-					if ((mask.at<char>(j, k) & H_MASK) != 0){
-						maskfound++;
-					}
+			//If fitting on both upper and lower parts is bad - the constant factor is negative
+			if (lin_model_midu[0] > 0 && lin_model_midl[0] > 0){
+				//Revert back to additive model
+				if (ncu.valid){
+					lin_model_midu[0] = ncu.median - cu.median;
+					lin_model_midu[1] = 1.0;
 				}
-
-				if (maskfound > 0){
-					//Mark as vertical cradle (for cross section later on)
-					for (int k = p1; k <= p2; k++){
-						mask.at<char>(j, k) |= V_MASK;
-					}
-
-					if (segment_seek == 0){
-						//Vertical mask part reached
-						sample.end = j;
-						segment_samples[segment_cnt] = sample;
-						segment_cnt++;
-						segment_seek = 1;
-					}
+				else{
+					lin_model_midu[0] = ncl.median - cl.median;
+					lin_model_midu[1] = 1.0;
+				}
+				if (ncl.valid){
+					lin_model_midl[0] = ncl.median - cl.median;
+					lin_model_midl[1] = 1.0;
 				}
 				else{
-					//The current column contains no vertical cradle part
-					//Initializ new segment
-					if (segment_seek == 1){
-						segment_seek = 0;
-
-						sample = segment_samples[segment_cnt];
-						sample.start = j;
-						sample.end = -1;
-
-						//Initialize structure arrays
-						sample.ncu = std::vector<float>(img.rows);
-						std::fill(sample.ncu.begin(), sample.ncu.end(), -1);
-						sample.ncl = std::vector<float>(img.rows);
-						std::fill(sample.ncl.begin(), sample.ncl.end(), -1);
-						sample.cu = std::vector<float>(img.rows);
-						std::fill(sample.cu.begin(), sample.cu.end(), -1);
-						sample.cl = std::vector<float>(img.rows);
-						std::fill(sample.cl.begin(), sample.cl.end(), -1);
-					}
-
-					if (p1 - 2 * sfm >= 0){
-						//Sample above cradle
-						std::vector<float> medi(sfm + 1);
-						std::fill(medi.begin(), medi.end(), -1);
-						sample.ncu[j] = -1;
-						for (int z = std::max(0, p1 - 2 * sfm); z <= p1 - sfm; z++){
-							if ((mask.at<char>(j, z) & (H_MASK | DEFECT)) == 0){
-								medi[z - (p1 - 2 * sfm)] = filtered.at<float>(j, z);
-							}
-						}
-						sample.ncu[j] = getMedian(medi);
-
-						if ((mask.at<char>(j, p1 + sfm) & (H_MASK | DEFECT)) == 0){
-							sample.cu[j] = filtered.at<float>(j, p1 + sfm);
-						}
-						else{
-							sample.cu[j] = -1;
-						}
-					}
-
-					if (p2 + 2 * sfm < mask.cols){
-						//Sample below cradle
-						std::vector<float> medi(sfm + 1);
-						std::fill(medi.begin(), medi.end(), -1);
-						sample.ncl[j] = -1;
-						for (int z = p2 + sfm; z < std::min(p2 + 2 * sfm, filtered.cols); z++){
-							if ((mask.at<char>(j, z) & (H_MASK | DEFECT)) == 0){
-								medi[z - p2 - sfm] = filtered.at<float>(j, z);
-							}
-						}
-						sample.ncl[j] = getMedian(medi);
-
-						if ((mask.at<char>(j, p2 - sfm) & (H_MASK | DEFECT)) == 0){
-							sample.cl[j] = filtered.at<float>(j, p2 - sfm);
-						}
-						else{
-							sample.cl[j] = -1;
-						}
-					}
+					lin_model_midl[0] = lin_model_midu[0];
+					lin_model_midl[1] = lin_model_midu[1];
 				}
 			}
-
-			//Add end to the last segment part
-			if (sample.end == -1){
-				//Vertical mask part reached
-				sample.end = img.rows - 1;
-				segment_samples[segment_cnt] = sample;
-				segment_cnt++;
+			else{
+				if (lin_model_midu[0] > 0){
+					lin_model_midu[0] = lin_model_midl[0];
+					lin_model_midu[1] = lin_model_midl[1];
+				}
+				if (lin_model_midl[0] > 0){
+					lin_model_midl[0] = lin_model_midu[0];
+					lin_model_midl[1] = lin_model_midu[1];
+				}
 			}
 
-			vm[i] = std::vector<std::vector<float>>(segment_cnt);
-
-			//Fit model on each segment
-			for (int s = 0; s < segment_cnt; s++){
-
-				sample = segment_samples[s];
-
-				//Increment counter for total number of pieces
-				ms.pieces++;
-				ms.piece_type.push_back(VERTICAL_DIR);
-				ms.pieceIDv[i].push_back(ms.pieces);
-
-				//Mark middle
-				ms.piece_middle.push_back(cv::Point2i((sample.end + sample.start) / 2, midpos[i][(sample.end + sample.start) / 2]));
-
-				std::vector<float> lin_model_midu(2), lin_model_midl(2);
-
-				lin_model_midu = linearFitting(sample.cu, sample.ncu);
-				if (getMedian(sample.ncl) != -1){
-					lin_model_midl = linearFitting(sample.cl, sample.ncl);
+			if (lin_model_midu[1] > 1.2 && lin_model_midl[1] > 1.2){
+				//Revert back to additive model
+				if (ncu.valid){
+					lin_model_midu[0] = ncu.median - cu.median;
+					lin_model_midu[1] = 1.0;
+				}
+				else{
+					lin_model_midu[0] = ncl.median - cl.median;
+					lin_model_midu[1] = 1.0;
+				}
+				if (ncl.valid){
+					lin_model_midl[0] = ncl.median - cl.median;
+					lin_model_midl[1] = 1.0;
 				}
 				else{
 					lin_model_midl[0] = lin_model_midu[0];
 					lin_model_midl[1] = lin_model_midu[1];
 				}
-				if (getMedian(sample.ncu) == -1){
+			}
+			else{
+				if (lin_model_midu[1] > 1.2){
 					lin_model_midu[0] = lin_model_midl[0];
 					lin_model_midu[1] = lin_model_midl[1];
 				}
-
-				std::vector<float> v1, v2;
-				for (int zz = 0; zz < sample.cl.size(); zz++){
-					if (sample.cl[zz] != -1 && sample.ncl[zz] != -1){
-						v1.push_back(sample.cl[zz]);
-						v2.push_back(sample.ncl[zz]);
-					}
-				}
-				for (int zz = 0; zz < sample.cu.size(); zz++){
-					if (sample.cu[zz] != -1 && sample.ncu[zz] != -1){
-						v1.push_back(sample.cu[zz]);
-						v2.push_back(sample.ncu[zz]);
-					}
+				if (lin_model_midl[1] > 1.2){
+					lin_model_midl[0] = lin_model_midu[0];
+					lin_model_midl[1] = lin_model_midu[1];
 				}
+			}
 
-				//If fitting on both upper and lower parts is bad - the constant factor is negative
-				if (lin_model_midu[0] > 0 && lin_model_midl[0] > 0){
-					//Revert back to additive model
-					if (getMedian(sample.ncu) != -1){
-						lin_model_midu[0] = getMedian(sample.ncu) - getMedian(sample.cu);
-						lin_model_midu[1] = 1.0;
-					}
-					else{
-						lin_model_midu[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midu[1] = 1.0;
-					}
-					if (getMedian(sample.ncl) != -1){
-						lin_model_midl[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midl[1] = 1.0;
-					}
-					else{
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
-					}
+			//If fitting on both upper and lower parts is bad - multiplicative factor is too small
+			if (lin_model_midu[1] < 0.9 && lin_model_midl[1] < 0.9){
+				//Revert back to additive model
+				if (ncu.valid){
+					lin_model_midu[0] = ncu.median - cu.median;
+					lin_model_midu[1] = 1.0;
 				}
 				else{
-					if (lin_model_midu[0] > 0){
-						lin_model_midu[0] = lin_model_midl[0];
-						lin_model_midu[1] = lin_model_midl[1];
-					}
-					if (lin_model_midl[0] > 0){
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
-					}
+					lin_model_midu[0] = ncl.median - cl.median;
+					lin_model_midu[1] = 1.0;
 				}
-
-				if (lin_model_midu[1] > 1.2 && lin_model_midl[1] > 1.2){
-					//Revert back to additive model
-					if (getMedian(sample.ncu) != -1){
-						lin_model_midu[0] = getMedian(sample.ncu) - getMedian(sample.cu);
-						lin_model_midu[1] = 1.0;
-					}
-					else{
-						lin_model_midu[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midu[1] = 1.0;
-					}
-					if (getMedian(sample.ncl) != -1){
-						lin_model_midl[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midl[1] = 1.0;
-					}
-					else{
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
-					}
+				if (ncl.valid){
+					lin_model_midl[0] = ncl.median - cl.median;
+					lin_model_midl[1] = 1.0;
 				}
 				else{
-					if (lin_model_midu[1] > 1.2){
-						lin_model_midu[0] = lin_model_midl[0];
-						lin_model_midu[1] = lin_model_midl[1];
-					}
-					if (lin_model_midl[1] > 1.2){
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
-					}
+					lin_model_midl[0] = lin_model_midu[0];
+					lin_model_midl[1] = lin_model_midu[1];
 				}
-
-				//If fitting on both upper and lower parts is bad - multiplicative factor is too small
-				if (lin_model_midu[1] < 0.9 && lin_model_midl[1] < 0.9){
-					//Revert back to additive model
-					if (getMedian(sample.ncu) != -1){
-						lin_model_midu[0] = getMedian(sample.ncu) - getMedian(sample.cu);
-						lin_model_midu[1] = 1.0;
-					}
-					else{
-						lin_model_midu[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midu[1] = 1.0;
-					}
-					if (getMedian(sample.ncl) != -1){
-						lin_model_midl[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midl[1] = 1.0;
-					}
-					else{
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
-					}
+			}
+			else{
+				if (lin_model_midu[1] < 0.9){
+					lin_model_midu[0] = lin_model_midl[0];
+					lin_model_midu[1] = lin_model_midl[1];
 				}
-				else{
-					if (lin_model_midu[1] < 0.9){
-						lin_model_midu[0] = lin_model_midl[0];
-						lin_model_midu[1] = lin_model_midl[1];
-					}
-					if (lin_model_midl[1] < 0.9){
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
-					}
+				if (lin_model_midl[1] < 0.9){
+					lin_model_midl[0] = lin_model_midu[0];
+					lin_model_midl[1] = lin_model_midu[1];
 				}
+			}
 
-				//Save out fitted model for later usage
-				vm[i][s] = std::vector<float>(5);
-				vm[i][s][0] = lin_model_midu[0];
-				vm[i][s][1] = lin_model_midu[1];
-				vm[i][s][2] = lin_model_midl[0];
-				vm[i][s][3] = lin_model_midl[1];
-				vm[i][s][4] = (sample.end + sample.start) / 2;
+			//Save out fitted model for later usage
+			vmi[s] = std::vector<float>(5);
+			vmi[s][0] = lin_model_midu[0];
+			vmi[s][1] = lin_model_midu[1];
+			vmi[s][2] = lin_model_midl[0];
+			vmi[s][3] = lin_model_midl[1];
+			vmi[s][4] = (sample.end + sample.start) / 2;
 
-				//Remove cradle
-				std::vector<int> p1v(sample.end - sample.start + 1), p2v(sample.end - sample.start + 1);
-				for (int j = sample.start; j <= sample.end; j++){
+			//Remove cradle
+			std::vector<int> p1v(sample.end - sample.start + 1), p2v(sample.end - sample.start + 1);
+			for (int j = sample.start; j <= sample.end; j++){
 
-					//Find start/end of cradle part
-					int p1, p2;
-					p1 = p2 = midpos[i][j];
+				//Find start/end of cradle part
+				int p1, p2;
+				p1 = p2 = midpos[j];
 
-					while (p1 > 0 && (mask.at<char>(j, p1) & V_MASK) == V_MASK)
-						p1--;
-					while (p2 < mask.cols - 1 && (mask.at<char>(j, p2) & V_MASK) == V_MASK)
-						p2++;
+				while (p1 > 0 && (mask.at<char>(j, p1) & V_MASK) == V_MASK)
+					p1--;
+				while (p2 < mask.cols - 1 && (mask.at<char>(j, p2) & V_MASK) == V_MASK)
+					p2++;
 
-					p1v[j - sample.start] = p1;
-					p2v[j - sample.start] = p2;
+				p1v[j - sample.start] = p1;
+				p2v[j - sample.start] = p2;
 
-					//Mark as vertical cradle
-					for (int k = p1; k <= p2; k++){
-						mask.at<char>(j, k) |= V_MASK;
-					}
+				//Mark as vertical cradle
+				for (int k = p1; k <= p2; k++){
+					mask.at<char>(j, k) |= V_MASK;
+				}
 
-					//Remove intensity from middle of cradle based on interpolation of the two edge profiles
-					for (int k = p1 + sfm / 2; k < p2 - sfm / 2; k++){
-						if (((mask.at<char>(j, k)) & (H_MASK | DEFECT)) == 0){
-							float pv = img.at<float>(j, k);
+				//Remove intensity from middle of cradle based on interpolation of the two edge profiles
+				for (int k = p1 + sfm / 2; k < p2 - sfm / 2; k++){
+					if (((mask.at<char>(j, k)) & (H_MASK | DEFECT)) == 0){
+						float pv = img.at<float>(j, k);
 
-							//Get the two estimations based on the edge profiles
-							float epv1 = lin_model_midu[1] * pv + lin_model_midu[0];
-							float epv2 = lin_model_midl[1] * pv + lin_model_midl[0];
+						//Get the two estimations based on the edge profiles
+						float epv1 = lin_model_midu[1] * pv + lin_model_midu[0];
+						float epv2 = lin_model_midl[1] * pv + lin_model_midl[0];
 
-							//Take weighted average of approximations
-							float iv = (k - p1 - sfm) * 1.0 / (p2 - p1 - 2 * sfm)*(epv2 - epv1) + epv1;
+						//Take weighted average of approximations
+						float iv = (k - p1 - sfm) * 1.0 / (p2 - p1 - 2 * sfm)*(epv2 - epv1) + epv1;
 
-							ms.piece_mask.at<ushort>(j, k) = ms.pieces;
-							cradle.at<float>(j, k) = pv - iv;
-						}
+						addLabel(segs, j, k, id);
+						cradle.at<float>(j, k) = pv - iv;
 					}
 				}
+			}
 
-				std::vector<float> edgemap;
-				std::vector<int> cnt;
-				float minv, maxv;
-				int first, last, separation;
-
-				//Remove edge - upper
-				edgemap = std::vector<float>(2 * sfm + 1);
-				cnt = std::vector<int>(2 * sfm + 1);
-
-				//Model cradle edge
-				for (int j = sample.start; j <= sample.end; j++){
-					int mid = p1v[j - sample.start];
-					int lpmin = std::max(p1v[j - sample.start] - sfm, 0);
-					int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.cols - 1);
-					for (int l = lpmin; l <= lpmax; l++){
-						if ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0){
-							edgemap[mid - l + sfm] += filtered.at<float>(j, l);
-							cnt[mid - l + sfm]++;
-						}
+			std::vector<float> edgemap;
+			std::vector<int> cnt;
+			float minv, maxv;
+			int first, last, separation;
+
+			//Remove edge - upper
+			edgemap = std::vector<float>(2 * sfm + 1);
+			cnt = std::vector<int>(2 * sfm + 1);
+
+			//Model cradle edge
+			for (int j = sample.start; j <= sample.end; j++){
+				int mid = p1v[j - sample.start];
+				int lpmin = std::max(p1v[j - sample.start] - sfm, 0);
+				int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.cols - 1);
+				for (int l = lpmin; l <= lpmax; l++){
+					if ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0){
+						edgemap[mid - l + sfm] += filtered.at<float>(j, l);
+						cnt[mid - l + sfm]++;
 					}
 				}
-				for (int j = 0; j < edgemap.size(); j++){
-					if (cnt[j] != 0){
-						edgemap[j] /= cnt[j];
-					}
+			}
+			for (int j = 0; j < edgemap.size(); j++){
+				if (cnt[j] != 0){
+					edgemap[j] /= cnt[j];
 				}
+			}
 
-				first = 0;
-				while (first < edgemap.size() && cnt[first] == 0) first++;
-				last = edgemap.size() - 1;
-				while (last >= 0 && cnt[last] == 0) last--;
-
-				//Find proper edge of the cradle
-				separation = first;
-				minv = edgemap[first];
-				maxv = edgemap[first];
-				for (int j = first; j < last; j++){
-					if (edgemap[j] < minv)
-						minv = edgemap[j];
-					if (edgemap[j] > maxv)
-						maxv = edgemap[j];
-				}
-				while (edgemap[separation] >(minv + maxv) / 2){
-					separation++;
-				}
-
-				if (first < last){
-
-					//Remove edge
-					for (int j = sample.start; j <= sample.end; j++){
-						int bk = 0;
-						float mcost = 1e20;
-
-						//Find position that best fits the edge
-						for (int k = -step; k <= step; k++){
-							int lpmin = std::max(p1v[j - sample.start] - sfm, 0);
-							int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.cols - 1);
-							int mid = p1v[j - sample.start];
-							int c = 0;
-							float cost = 0;
-
-
-							float edgemean = 0;
-							float samplemean = 0;
-							//Get means of the two edge profiles
-							for (int l = lpmin; l < lpmax; l++){
-								int pos = mid - l + sfm + k;
-								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
-									samplemean += filtered.at<float>(j, l);
-									edgemean += edgemap[pos];
-									c++;
-								}
-							}
+			first = 0;
+			while (first < edgemap.size() && cnt[first] == 0) first++;
+			last = edgemap.size() - 1;
+			while (last >= 0 && cnt[last] == 0) last--;
 
-							samplemean /= c;
-							edgemean /= c;
-
-							//Check how well it fits
-							for (int l = lpmin; l < lpmax; l++){
-								int pos = mid - l + sfm + k;
-								if (pos >= 0 && pos < edgemap.size()){
-									if (edgemap[pos] != 0 && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
-										float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(j, l) - samplemean);
-										cost += tmp*tmp;
-									}
-								}
-							}
-							cost /= c;
+			//Find proper edge of the cradle
+			separation = first;
+			minv = edgemap[first];
+			maxv = edgemap[first];
+			for (int j = first; j < last; j++){
+				if (edgemap[j] < minv)
+					minv = edgemap[j];
+				if (edgemap[j] > maxv)
+					maxv = edgemap[j];
+			}
+			while (edgemap[separation] >(minv + maxv) / 2){
+				separation++;
+			}
 
-							if (cost < mcost){
-								mcost = cost;
-								bk = k;
-							}
-						}
+			if (first < last){
+
+				//Remove edge
+				for (int j = sample.start; j <= sample.end; j++){
+					int bk = 0;
+					float mcost = 1e20;
 
-						//Remove intensity
+					//Find position that best fits the edge
+					for (int k = -step; k <= step; k++){
 						int lpmin = std::max(p1v[j - sample.start] - sfm, 0);
 						int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.cols - 1);
 						int mid = p1v[j - sample.start];
+						int c = 0;
+						float cost = 0;
 
-						float ref = lin_model_midu[1] * filtered.at<float>(j, lpmax) + lin_model_midu[0];
-						float dif = filtered.at<float>(j, lpmax) - ref;
 
-						float a, b;
-						//Check if the edge is dropping or is just flat cradle
-						if (std::abs(edgemap[last] - edgemap[first]) < std::abs(dif) *0.5){
-							//Flat cradle, no edge
-							a = 0;
-							b = dif;
-						}
-						else{
-							//Regular decaying edge
-							a = dif / (edgemap[first] - edgemap[last]);
-							b = dif - a * edgemap[first];
+						float edgemean = 0;
+						float samplemean = 0;
+						//Get means of the two edge profiles
+						for (int l = lpmin; l < lpmax; l++){
+							int pos = mid - l + sfm + k;
+							if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
+								samplemean += filtered.at<float>(j, l);
+								edgemean += edgemap[pos];
+								c++;
+							}
 						}
 
+						samplemean /= c;
+						edgemean /= c;
+
+						//Check how well it fits
 						for (int l = lpmin; l < lpmax; l++){
-							int pos = mid - l + sfm + bk;
-							if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
-								cradle.at<float>(j, l) = a*edgemap[pos] + b;
-								if (pos <= separation){
-									ms.piece_mask.at<ushort>(j, l) = ms.pieces;
+							int pos = mid - l + sfm + k;
+							if (pos >= 0 && pos < edgemap.size()){
+								if (edgemap[pos] != 0 && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
+									float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(j, l) - samplemean);
+									cost += tmp*tmp;
 								}
 							}
 						}
+						cost /= c;
+
+						if (cost < mcost){
+							mcost = cost;
+							bk = k;
+						}
 					}
-				}
 
-				//Remove edge - lower
-				edgemap = std::vector<float>(2 * sfm + 1);
-				cnt = std::vector<int>(2 * sfm + 1);
+					//Remove intensity
+					int lpmin = std::max(p1v[j - sample.start] - sfm, 0);
+					int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.cols - 1);
+					int mid = p1v[j - sample.start];
+
+					float ref = lin_model_midu[1] * filtered.at<float>(j, lpmax) + lin_model_midu[0];
+					float dif = filtered.at<float>(j, lpmax) - ref;
 
-				//Model cradle edge
-				for (int j = sample.start; j <= sample.end; j++){
-					int mid = p2v[j - sample.start];
-					int lpmin = std::max(p2v[j - sample.start] - sfm, 0);
-					int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.cols - 1);
-					for (int l = lpmin; l <= lpmax; l++){
-						if ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0){
-							edgemap[mid - l + sfm] += filtered.at<float>(j, l);
-							cnt[mid - l + sfm]++;
+					float a, b;
+					//Check if the edge is dropping or is just flat cradle
+					if (std::abs(edgemap[last] - edgemap[first]) < std::abs(dif) *0.5){
+						//Flat cradle, no edge
+						a = 0;
+						b = dif;
+					}
+					else{
+						//Regular decaying edge
+						a = dif / (edgemap[first] - edgemap[last]);
+						b = dif - a * edgemap[first];
+					}
+
+					for (int l = lpmin; l < lpmax; l++){
+						int pos = mid - l + sfm + bk;
+						if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
+							cradle.at<float>(j, l) = a*edgemap[pos] + b;
+							if (pos <= separation){
+								addLabel(segs, j, l, id);
+							}
 						}
 					}
 				}
-				for (int j = 0; j < edgemap.size(); j++){
-					if (cnt[j] != 0){
-						edgemap[j] /= cnt[j];
+			}
+
+			//Remove edge - lower
+			edgemap = std::vector<float>(2 * sfm + 1);
+			cnt = std::vector<int>(2 * sfm + 1);
+
+			//Model cradle edge
+			for (int j = sample.start; j <= sample.end; j++){
+				int mid = p2v[j - sample.start];
+				int lpmin = std::max(p2v[j - sample.start] - sfm, 0);
+				int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.cols - 1);
+				for (int l = lpmin; l <= lpmax; l++){
+					if ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0){
+						edgemap[mid - l + sfm] += filtered.at<float>(j, l);
+						cnt[mid - l + sfm]++;
 					}
 				}
+			}
+			for (int j = 0; j < edgemap.size(); j++){
+				if (cnt[j] != 0){
+					edgemap[j] /= cnt[j];
+				}
+			}
 
-				first = 0;
-				while (first < edgemap.size() && cnt[first] == 0) first++;
-				last = edgemap.size() - 1;
-				while (last >= 0 && cnt[last] == 0) last--;
-				
-				//Find proper edge of the cradle
-				separation = last - 1;
-				minv = edgemap[separation];
-				maxv = edgemap[separation];
-				for (int j = first; j < last; j++){
-					if (edgemap[j] < minv)
-						minv = edgemap[j];
-					if (edgemap[j] > maxv)
-						maxv = edgemap[j];
-				}
-				while (edgemap[separation] >(minv + maxv) / 2){
-					separation--;
-				}
-
-				if (first < last){
-
-					//Remove edge
-					for (int j = sample.start; j <= sample.end; j++){
-						int bk = 0;
-						float mcost = 1e20;
-
-						//Find position that best fits the edge
-						for (int k = -step; k <= step; k++){
-							int lpmin = std::max(p2v[j - sample.start] - sfm, 0);
-							int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.cols - 1);
-							int mid = p2v[j - sample.start];
-							int c = 0;
-							float cost = 0;
-
-							float edgemean = 0;
-							float samplemean = 0;
-							//Get means of the two edge profiles
-							for (int l = lpmin; l < lpmax; l++){
-								int pos = mid - l + sfm + k;
-								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
-									samplemean += filtered.at<float>(j, l);
-									edgemean += edgemap[pos];
-									c++;
-								}
-							}
+			first = 0;
+			while (first < edgemap.size() && cnt[first] == 0) first++;
+			last = edgemap.size() - 1;
+			while (last >= 0 && cnt[last] == 0) last--;
+			
+			//Find proper edge of the cradle
+			separation = last - 1;
+			minv = edgemap[separation];
+			maxv = edgemap[separation];
+			for (int j = first; j < last; j++){
+				if (edgemap[j] < minv)
+					minv = edgemap[j];
+				if (edgemap[j] > maxv)
+					maxv = edgemap[j];
+			}
+			while (edgemap[separation] >(minv + maxv) / 2){
+				separation--;
+			}
 
-							samplemean /= c;
-							edgemean /= c;
-
-							//Check how well it fits
-							for (int l = lpmin; l < lpmax; l++){
-								int pos = mid - l + sfm + k;
-								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
-									if (edgemap[pos] != 0){
-										float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(j, l) - samplemean);
-										cost += tmp*tmp;
-									}
-								}
-							}
-							cost /= c;
+			if (first < last){
 
-							if (cost < mcost){
-								mcost = cost;
-								bk = k;
-							}
-						}
+				//Remove edge
+				for (int j = sample.start; j <= sample.end; j++){
+					int bk = 0;
+					float mcost = 1e20;
 
-						//Remove intensity
+					//Find position that best fits the edge
+					for (int k = -step; k <= step; k++){
 						int lpmin = std::max(p2v[j - sample.start] - sfm, 0);
 						int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.cols - 1);
 						int mid = p2v[j - sample.start];
+						int c = 0;
+						float cost = 0;
 
-						float ref = lin_model_midl[1] * filtered.at<float>(j, lpmin) + lin_model_midl[0];// filtered.at<float>(lpmax, j);
-						float dif = filtered.at<float>(j, lpmin) - ref;
-						float a, b;
-
-						//Check if the edge is dropping or is just flat cradle
-						if (std::abs(edgemap[last] - edgemap[first]) < std::abs(dif) *0.5){
-							//Flat cradle, no edge
-							a = 0;
-							b = dif;
-						}
-						else{
-							//Regular decaying edge
-							a = dif / (edgemap[last] - edgemap[first]);
-							b = dif - a * edgemap[last];
+						float edgemean = 0;
+						float samplemean = 0;
+						//Get means of the two edge profiles
+						for (int l = lpmin; l < lpmax; l++){
+							int pos = mid - l + sfm + k;
+							if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
+								samplemean += filtered.at<float>(j, l);
+								edgemean += edgemap[pos];
+								c++;
+							}
 						}
 
+						samplemean /= c;
+						edgemean /= c;
+
+						//Check how well it fits
 						for (int l = lpmin; l < lpmax; l++){
-							int pos = mid - l + sfm + bk;
+							int pos = mid - l + sfm + k;
 							if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
-								cradle.at<float>(j, l) = a*edgemap[pos] + b;
-								if (pos >= separation){
-									ms.piece_mask.at<ushort>(j, l) = ms.pieces;
+								if (edgemap[pos] != 0){
+									float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(j, l) - samplemean);
+									cost += tmp*tmp;
 								}
 							}
 						}
+						cost /= c;
+
+						if (cost < mcost){
+							mcost = cost;
+							bk = k;
+						}
+					}
+
+					//Remove intensity
+					int lpmin = std::max(p2v[j - sample.start] - sfm, 0);
+					int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.cols - 1);
+					int mid = p2v[j - sample.start];
+
+					float ref = lin_model_midl[1] * filtered.at<float>(j, lpmin) + lin_model_midl[0];// filtered.at<float>(lpmax, j);
+					float dif = filtered.at<float>(j, lpmin) - ref;
+					float a, b;
+
+					//Check if the edge is dropping or is just flat cradle
+					if (std::abs(edgemap[last] - edgemap[first]) < std::abs(dif) *0.5){
+						//Flat cradle, no edge
+						a = 0;
+						b = dif;
+					}
+					else{
+						//Regular decaying edge
+						a = dif / (edgemap[last] - edgemap[first]);
+						b = dif - a * edgemap[last];
+					}
+
+					for (int l = lpmin; l < lpmax; l++){
+						int pos = mid - l + sfm + bk;
+						if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
+							cradle.at<float>(j, l) = a*edgemap[pos] + b;
+							if (pos >= separation){
+								addLabel(segs, j, l, id);
+							}
+						}
 					}
 				}
 			}
 		}
+
+		return true;
 	}
-	
-	//Remove horizontal cradle pieces and save out correction model used for later usage
-	void removeHorizontal(
+
+	//Remove vertical cradle pieces and save out correction model used for later usage
+	void removeVertical(
 		const cv::Mat &img,									//Input grayscale float X-ray image
-		cv::Mat &mask,										//Mask containing marked horizontal and/or vertical cradle positions
+		cv::Mat &mask,										//Mask containing marked vertical and/or horizontal cradle positions
 		cv::Mat &cradle,									//Cradle component after separation saved out here
-		std::vector<std::vector<int>> &midpos_points,		//Center of horizontal cradle pieces
-		std::vector<int> s,									//Width of horizontal cradle pieces
-		std::vector<std::vector<std::vector<float>>> &hm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
+		std::vector<std::vector<int>> &midpos_points,		//Center of vertical cradle pieces
+		std::vector<int> s,									//Width of vertical cradle pieces
+		std::vector<std::vector<std::vector<float>>> &vm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
 		MarkedSegments &ms									//MarkedSegment structure will contain processing information
 	){
-
 		//Set avg_s as a function of the average cradle-piece thickness
 		float avg = 0;
 		int avg_s;
@@ -1386,642 +1590,883 @@ namespace CradleFunctions{
 
 		//Directional smoothing of image
 		cv::Mat smooth, filtered;
-		smooth = cv::Mat(1, avg_s, CV_32F, cv::Scalar(1.0 / avg_s));
+		smooth = cv::Mat(avg_s, 1, CV_32F, cv::Scalar(1.0 / avg_s));
 		cv::filter2D(img, filtered, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
 
-		int vtot = midpos_points.size();	//Total number of horizontal pieces
-		std::vector<std::vector<int>> midpos(vtot);
-		hm = std::vector<std::vector<std::vector<float>>>(vtot);
-
-		//Cover all horizontal cradles
-		for (int i = 0; i < vtot; i++){
-			// progress/abort
-			if (!progress(i, vtot))
-				return;
-
-			//Set adaptively value of s
-			int sfm = s[i] * 0.1;
-
-			//Create midpos vector (interpolate two points for all columns)
-			midpos[i] = std::vector<int>(img.cols);
-			int x1 = midpos_points[i][0];
-			int y1 = midpos_points[i][1];
-			int x2 = midpos_points[i][2];
-			int y2 = midpos_points[i][3];
+		int vtot = midpos_points.size();	//Total number of vertical pieces
+		vm = std::vector<std::vector<std::vector<float>>>(vtot);
 
-			if (x2 == x1){
-				//This is a vertical line -> invalid for a horizontal cradle piece
-				return; //Stuff went wrong
-			}
-			else{
-				float m = (y2 - y1) * 1.0 / (x2 - x1);
-				//Fill up midpoints
-				for (int j = 0; j < img.cols; j++){
-					midpos[i][j] = m * (j - x1) + y1;
+		//Cover all vertical cradles
+		removePieces(validPieces(midpos_points), ms, [&](int i, PieceSegments &segs){
+			return removeVerticalPiece(i, img, filtered, mask, cradle, midpos_points, s, vm[i], segs);
+		}, [&](int i, const PieceSegments &segs){
+			return commitSegments(ms, segs, VERTICAL_DIR, NULL, &ms.pieceIDv[i]);
+		});
+	}
+	
+	//Cache-blocked transpose of a single channel image; dst may be a header of preallocated memory of the right size
+	template <typename T>
+	static void transposeTile(const cv::Mat &src, cv::Mat &dst){
+		const int bs = 32;
+		dst.create(src.cols, src.rows, src.type());
+		for (int i0 = 0; i0 < src.rows; i0 += bs){
+			for (int j0 = 0; j0 < src.cols; j0 += bs){
+				int i1 = std::min(i0 + bs, src.rows), j1 = std::min(j0 + bs, src.cols);
+				for (int i = i0; i < i1; i++){
+					const T *sp = src.ptr<T>(i);
+					for (int j = j0; j < j1; j++){
+						dst.ptr<T>(j)[i] = sp[j];
+					}
 				}
 			}
+		}
+	}
 
-			//Pairwise samples for fitting (upper and lower edges)
-			std::vector<cradle_sample_pairs> segment_samples(100);
-			cradle_sample_pairs sample = segment_samples[0];
-			int segment_cnt = 0;
-			int segment_seek = 1;
-
-			//Sample cradle/noncradle pairs
-			for (int j = 0; j < img.cols; j++){
-
-				//Find start/end of cradle part
-				int p1, p2;
-				p1 = p2 = midpos[i][j];
-
-				while (p1 > 0 && (mask.at<char>(p1, j) & H_MASK) == H_MASK)
-					p1--;
-				while (p2 < mask.rows - 1 && (mask.at<char>(p2, j) & H_MASK) == H_MASK)
-					p2++;
-
-				int start = std::max(0, p1 - sfm);
-				int end = std::min(img.rows - 1, p2 + sfm);
+	//Pixels of a transposed band written by removeHorizontalTile()
+	static const uchar TILE_CRADLE = 1;
+	static const uchar TILE_MASK = 2;
+
+	//Kernel of horizontal cradle removal. It runs on the transposed band of the piece, so that rows of the tiles are
+	//image columns and the profiles across the piece are read from contiguous memory
+	static void removeHorizontalTile(
+		const cv::Mat &img,									//Transposed band of the input image
+		const cv::Mat &filtered,							//Transposed band of the smoothed input image
+		cv::Mat &mask,										//Transposed band of the mask
+		cv::Mat &cradle,									//Transposed band of the cradle component
+		cv::Mat &written,									//Transposed band flagging the pixels written by the kernel (TILE_*)
+		std::vector<int> &midpos,							//Center of the piece for all image columns, relative to the band
+		int r0,												//First image row of the band
+		int sfm,											//Sampling distance from the cradle edges
+		std::vector<std::vector<float>> &hmi,				//Saves out parameters of the fitted multiplicative model of the piece
+		PieceSegments &segs									//Segments of the piece
+	){
+		//Pairwise samples for fitting (upper and lower edges), each segment is a span of them
+		cradle_sample_pairs samples = createSamplePairs(img.rows);
+		std::vector<sample_span> segment_samples;
+		sample_span sample = {0, 0};
+		int segment_cnt = 0;
+		int segment_seek = 1;
+
+		//Window of the local medians next to the cradle edges, reused for all rows
+		std::vector<float> medi;
+		medi.reserve(sfm + 1);
+
+		//Sample cradle/noncradle pairs
+		for (int j = 0; j < img.rows; j++){
+
+			//Find start/end of cradle part
+			int p1, p2;
+			p1 = p2 = midpos[j];
+
+			while (p1 > 0 && (mask.at<char>(j, p1) & H_MASK) == H_MASK)
+				p1--;
+			while (p2 < mask.cols - 1 && (mask.at<char>(j, p2) & H_MASK) == H_MASK)
+				p2++;
+
+			int start = std::max(0, p1 - sfm);
+			int end = std::min(img.cols - 1, p2 + sfm);
+
+			//Check if contains vertical mask
+			int maskfound = 0;
+			for (int k = start; k <= end; k++){
+				if ((mask.at<char>(j, k) & V_MASK) != 0){
+					maskfound++;
+				}
+			}
 
-				//Check if contains vertical mask
-				int maskfound = 0;
-				for (int k = start; k <= end; k++){
-					if ((mask.at<char>(k, j) & V_MASK) != 0){
-						maskfound++;
-					}
+			if (maskfound > 0){
+				if (segment_seek == 0){
+					//Vertical mask part reached
+					sample.end = j;
+					segment_samples.push_back(sample);
+					segment_cnt++;
+					segment_seek = 1;
 				}
+			}
+			else{
+				//The current column contains no vertical cradle part
+				//Initializ new segment
+				if (segment_seek == 1){
+					segment_seek = 0;
 
-				if (maskfound > 0){
-					if (segment_seek == 0){
-						//Vertical mask part reached
-						sample.end = j;
-						segment_samples[segment_cnt] = sample;
-						segment_cnt++;
-						segment_seek = 1;
-					}
+					sample.start = j;
+					sample.end = -1;
 				}
-				else{
-					//The current column contains no vertical cradle part
-					//Initializ new segment
-					if (segment_seek == 1){
-						segment_seek = 0;
-
-						sample = segment_samples[segment_cnt];
-						sample.start = j;
-						sample.end = -1;
-
-						//Initialize structure arrays
-						sample.ncu = std::vector<float>(img.cols);
-						std::fill(sample.ncu.begin(), sample.ncu.end(), -1);
-						sample.cu = std::vector<float>(img.cols);
-						std::fill(sample.cu.begin(), sample.cu.end(), -1);
-						sample.ncl = std::vector<float>(img.cols);
-						std::fill(sample.ncl.begin(), sample.ncl.end(), -1);
-						sample.cl = std::vector<float>(img.cols);
-						std::fill(sample.cl.begin(), sample.cl.end(), -1);
-					}
 
-					//Sample above cradle
-					if (p1 - 2 * sfm >= 0){
-						std::vector<float> medi(sfm + 1);
-						std::fill(medi.begin(), medi.end(), -1);
-						sample.ncu[j] = -1;
-						for (int z = std::max(0, p1 - 2 * sfm); z <= p1 - sfm; z++){
-							if ((mask.at<char>(z, j) & (V_MASK | DEFECT)) == 0){
-								medi[z - (p1 - 2 * sfm)] = filtered.at<float>(z, j);
-							}
+				//Sample above cradle
+				if (p1 - 2 * sfm >= 0){
+					medi.clear();
+					for (int z = std::max(0, p1 - 2 * sfm); z <= p1 - sfm; z++){
+						if ((mask.at<char>(j, z) & (V_MASK | DEFECT)) == 0){
+							medi.push_back(filtered.at<float>(j, z));
 						}
-						sample.ncu[j] = getMedian(medi);
+					}
+					if (!medi.empty()){
+						samples.ncu[j] = RobustStats::median(medi);
+						samples.valid[j] |= SAMPLE_NCU;
+					}
 
-						if ((mask.at<char>(p1 + sfm, j) & (V_MASK | DEFECT)) == 0){
-							sample.cu[j] = filtered.at<float>(p1 + sfm, j);
-						}
-						else{
-							sample.cu[j] = -1;
-						}
+					if ((mask.at<char>(j, p1 + sfm) & (V_MASK | DEFECT)) == 0){
+						samples.cu[j] = filtered.at<float>(j, p1 + sfm);
+						samples.valid[j] |= SAMPLE_CU;
 					}
+				}
 
-					//Sample below cradle
-					if (p2 + 2 * sfm < filtered.rows){
-						std::vector<float> medi(sfm + 1);
-						std::fill(medi.begin(), medi.end(), -1);
-						sample.ncl[j] = -1;
-						for (int z = p2 + sfm; z < std::min(p2 + 2 * sfm, filtered.rows); z++){
-							if ((mask.at<char>(z, j) & (V_MASK | DEFECT)) == 0){
-								medi[z - p2 - sfm] = filtered.at<float>(z, j);
-							}
+				//Sample below cradle
+				if (p2 + 2 * sfm < filtered.cols){
+					medi.clear();
+					for (int z = p2 + sfm; z < std::min(p2 + 2 * sfm, filtered.cols); z++){
+						if ((mask.at<char>(j, z) & (V_MASK | DEFECT)) == 0){
+							medi.push_back(filtered.at<float>(j, z));
 						}
-						sample.ncl[j] = getMedian(medi);
+					}
+					if (!medi.empty()){
+						samples.ncl[j] = RobustStats::median(medi);
+						samples.valid[j] |= SAMPLE_NCL;
+					}
 
-						if ((mask.at<char>(p2 - sfm, j) & (V_MASK | DEFECT)) == 0){
-							sample.cl[j] = filtered.at<float>(p2 - sfm, j);
-						}
-						else{
-							sample.cl[j] = -1;
-						}
+					if ((mask.at<char>(j, p2 - sfm) & (V_MASK | DEFECT)) == 0){
+						samples.cl[j] = filtered.at<float>(j, p2 - sfm);
+						samples.valid[j] |= SAMPLE_CL;
 					}
 				}
 			}
+		}
 
-			//Add end to the last segment part
-			if (sample.end == -1){
-				//Vertical mask part reached
-				sample.end = img.cols - 1;
-				segment_samples[segment_cnt] = sample;
-				segment_cnt++;
-			}
+		//Add end to the last segment part
+		if (sample.end == -1){
+			//Vertical mask part reached
+			sample.end = img.rows - 1;
+			segment_samples.push_back(sample);
+			segment_cnt++;
+		}
+
+		//Initialize fitted model array
+		hmi = std::vector<std::vector<float>>(segment_cnt);
 
-			//Initialize fitted model array
-			hm[i] = std::vector<std::vector<float>>(segment_cnt);
+		//Scratch buffers for the compacted valid samples of a segment
+		std::vector<float> wx, wy;
 
-			//Fit model on each segment
-			for (int s = 0; s < segment_cnt; s++){
+		//Fit model on each segment
+		for (int s = 0; s < segment_cnt; s++){
 
-				sample = segment_samples[s];
+			sample = segment_samples[s];
 
-				//Mark middle
-				ms.piece_middle.push_back(cv::Point2i(midpos[i][(sample.end + sample.start) / 2], (sample.end + sample.start) / 2));
+			//New segment, marked at its middle
+			int id = addSegment(segs, cv::Point2i(midpos[(sample.end + sample.start) / 2] + r0, (sample.end + sample.start) / 2));
 
-				//Increment counter for total number of pieces
-				ms.pieces++;
-				ms.piece_type.push_back(HORIZONTAL_DIR);
-				ms.pieceIDh[i].push_back(ms.pieces);
+			std::vector<float> lin_model_midu(2), lin_model_midl(2);
 
-				std::vector<float> lin_model_midu(2), lin_model_midl(2);
+			//Robust statistics of the sampled profiles, shared by the model checks below
+			SampleStats ncu = spanStats(samples, samples.ncu, SAMPLE_NCU, sample, wx), cu = spanStats(samples, samples.cu, SAMPLE_CU, sample, wx);
+			SampleStats ncl = spanStats(samples, samples.ncl, SAMPLE_NCL, sample, wx), cl = spanStats(samples, samples.cl, SAMPLE_CL, sample, wx);
 
-				lin_model_midu = linearFitting(sample.cu, sample.ncu);
-				if (getMedian(sample.ncl) != -1){
-					lin_model_midl = linearFitting(sample.cl, sample.ncl);
+			lin_model_midu = spanFitting(samples, samples.cu, samples.ncu, SAMPLE_CU | SAMPLE_NCU, sample, wx, wy);
+			if (ncl.valid){
+				lin_model_midl = spanFitting(samples, samples.cl, samples.ncl, SAMPLE_CL | SAMPLE_NCL, sample, wx, wy);
+			}
+			else{
+				lin_model_midl[0] = lin_model_midu[0];
+				lin_model_midl[1] = lin_model_midu[1];
+			}
+			if (!ncu.valid){
+				lin_model_midu[0] = lin_model_midl[0];
+				lin_model_midu[1] = lin_model_midl[1];
+			}
+
+			//If fitting on both upper and lower parts is bad - constant factor is positive
+			if (lin_model_midu[0] > 0 && lin_model_midl[0] > 0){
+				//Revert back to additive model
+				if (ncu.valid){
+					lin_model_midu[0] = ncu.median - cu.median;
+					lin_model_midu[1] = 1.0;
+				}
+				else{
+					lin_model_midu[0] = ncl.median - cl.median;
+					lin_model_midu[1] = 1.0;
+				}
+				if (ncl.valid){
+					lin_model_midl[0] = ncl.median - cl.median;
+					lin_model_midl[1] = 1.0;
 				}
 				else{
 					lin_model_midl[0] = lin_model_midu[0];
 					lin_model_midl[1] = lin_model_midu[1];
 				}
-				if (getMedian(sample.ncu) == -1){
+			}
+			else{
+				if (lin_model_midu[0] > 0){
 					lin_model_midu[0] = lin_model_midl[0];
 					lin_model_midu[1] = lin_model_midl[1];
 				}
+				if (lin_model_midl[0] > 0){
+					lin_model_midl[0] = lin_model_midu[0];
+					lin_model_midl[1] = lin_model_midu[1];
+				}
+			}
 
-				//If fitting on both upper and lower parts is bad - constant factor is positive
-				if (lin_model_midu[0] > 0 && lin_model_midl[0] > 0){
-					//Revert back to additive model
-					if (getMedian(sample.ncu) != -1){
-						lin_model_midu[0] = getMedian(sample.ncu) - getMedian(sample.cu);
-						lin_model_midu[1] = 1.0;
-					}
-					else{
-						lin_model_midu[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midu[1] = 1.0;
-					}
-					if (getMedian(sample.ncl) != -1){
-						lin_model_midl[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midl[1] = 1.0;
-					}
-					else{
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
-					}
+
+			//If fitting on both upper and lower parts is bad - multiplicative factor is too big
+			if (lin_model_midu[1] > 1.2 && lin_model_midl[1] > 1.2){
+				//Revert back to additive model
+				if (ncu.valid){
+					lin_model_midu[0] = ncu.median - cu.median;
+					lin_model_midu[1] = 1.0;
 				}
 				else{
-					if (lin_model_midu[0] > 0){
-						lin_model_midu[0] = lin_model_midl[0];
-						lin_model_midu[1] = lin_model_midl[1];
-					}
-					if (lin_model_midl[0] > 0){
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
-					}
+					lin_model_midu[0] = ncl.median - cl.median;
+					lin_model_midu[1] = 1.0;
 				}
+				if (ncl.valid){
+					lin_model_midl[0] = ncl.median - cl.median;
+					lin_model_midl[1] = 1.0;
+				}
+				else{
+					lin_model_midl[0] = lin_model_midu[0];
+					lin_model_midl[1] = lin_model_midu[1];
+				}
+			}
+			else{
+				if (lin_model_midu[1] > 1.2){
+					lin_model_midu[0] = lin_model_midl[0];
+					lin_model_midu[1] = lin_model_midl[1];
+				}
+				if (lin_model_midl[1] > 1.2){
+					lin_model_midl[0] = lin_model_midu[0];
+					lin_model_midl[1] = lin_model_midu[1];
+				}
+			}
 
-
-				//If fitting on both upper and lower parts is bad - multiplicative factor is too big
-				if (lin_model_midu[1] > 1.2 && lin_model_midl[1] > 1.2){
-					//Revert back to additive model
-					if (getMedian(sample.ncu) != -1){
-						lin_model_midu[0] = getMedian(sample.ncu) - getMedian(sample.cu);
-						lin_model_midu[1] = 1.0;
-					}
-					else{
-						lin_model_midu[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midu[1] = 1.0;
-					}
-					if (getMedian(sample.ncl) != -1){
-						lin_model_midl[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midl[1] = 1.0;
-					}
-					else{
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
-					}
+			//If fitting on both upper and lower parts is bad - multiplicative factor is too small
+			if (lin_model_midu[1] < 0.9 && lin_model_midl[1] < 0.9){
+				//Revert back to additive model
+				if (ncu.valid){
+					lin_model_midu[0] = ncu.median - cu.median;
+					lin_model_midu[1] = 1.0;
 				}
 				else{
-					if (lin_model_midu[1] > 1.2){
-						lin_model_midu[0] = lin_model_midl[0];
-						lin_model_midu[1] = lin_model_midl[1];
-					}
-					if (lin_model_midl[1] > 1.2){
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
+					lin_model_midu[0] = ncl.median - cl.median;
+					lin_model_midu[1] = 1.0;
+				}
+				if (ncl.valid){
+					lin_model_midl[0] = ncl.median - cl.median;
+					lin_model_midl[1] = 1.0;
+				}
+				else{
+					lin_model_midl[0] = lin_model_midu[0];
+					lin_model_midl[1] = lin_model_midu[1];
+				}
+			}
+			else{
+				if (lin_model_midu[1] < 0.9){
+					lin_model_midu[0] = lin_model_midl[0];
+					lin_model_midu[1] = lin_model_midl[1];
+				}
+				if (lin_model_midl[1] < 0.9){
+					lin_model_midl[0] = lin_model_midu[0];
+					lin_model_midl[1] = lin_model_midu[1];
+				}
+			}
+
+			//Save out fitted model for later usage
+			hmi[s] = std::vector<float>(5);
+			hmi[s][0] = lin_model_midu[0];
+			hmi[s][1] = lin_model_midu[1];
+			hmi[s][2] = lin_model_midl[0];
+			hmi[s][3] = lin_model_midl[1];
+			hmi[s][4] = (sample.end + sample.start) / 2;
+
+			//Remove intensity from middle of cradle based on interpolation of the two edge profiles
+			std::vector<int> p1v(sample.end - sample.start + 1), p2v(sample.end - sample.start + 1);
+			for (int j = sample.start; j <= sample.end; j++){
+
+				//Find start/end of cradle part
+				int p1, p2;
+				p1 = p2 = midpos[j];
+
+				while (p1 > 0 && (mask.at<char>(j, p1) & H_MASK) == H_MASK)
+					p1--;
+				while (p2 < mask.cols - 1 && (mask.at<char>(j, p2) & H_MASK) == H_MASK)
+					p2++;
+
+				p1v[j - sample.start] = p1;
+				p2v[j - sample.start] = p2;
+
+				int start = std::max(0, p1 - sfm);
+				int end = std::min(img.cols - 1, p2 + sfm);
+
+				//Remove intensity from middle of cradle based on interpolation of the two edge profiles
+				for (int k = p1 + sfm / 2; k < p2 - sfm / 2; k++){
+					if (((mask.at<char>(j, k)) & (V_MASK | DEFECT)) == 0){
+						float pv = img.at<float>(j, k);
+
+						//Get the two estimations based on the edge profiles
+						float epv1 = lin_model_midu[1] * pv + lin_model_midu[0];
+						float epv2 = lin_model_midl[1] * pv + lin_model_midl[0];
+
+						//Take weighted average of approximations
+						float iv = (k - p1 - sfm) * 1.0 / (p2 - p1 - 2 * sfm)*(epv2 - epv1) + epv1;
+
+						addLabel(segs, j, r0 + k, id);
+						cradle.at<float>(j, k) = pv - iv;
+						mask.at<char>(j, k) |= H_MASK;
+						written.at<uchar>(j, k) = TILE_CRADLE | TILE_MASK;
 					}
 				}
+			}
 
-				//If fitting on both upper and lower parts is bad - multiplicative factor is too small
-				if (lin_model_midu[1] < 0.9 && lin_model_midl[1] < 0.9){
-					//Revert back to additive model
-					if (getMedian(sample.ncu) != -1){
-						lin_model_midu[0] = getMedian(sample.ncu) - getMedian(sample.cu);
-						lin_model_midu[1] = 1.0;
-					}
-					else{
-						lin_model_midu[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midu[1] = 1.0;
-					}
-					if (getMedian(sample.ncl) != -1){
-						lin_model_midl[0] = getMedian(sample.ncl) - getMedian(sample.cl);
-						lin_model_midl[1] = 1.0;
-					}
-					else{
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
+			std::vector<float> edgemap;
+			std::vector<std::vector<float>> edgesample;
+			std::vector<int> cnt;
+			float minv, maxv;
+			int first, last, separation;
+			int step = std::min(3, std::max(sfm / 5, 1));
+
+			//Remove edge - upper
+			edgesample = std::vector<std::vector<float>>(2 * sfm + 1);
+			for (int j = 0; j < edgesample.size(); j++){
+				edgesample[j] = std::vector<float>(sample.end - sample.start + 1);
+				std::fill(edgesample[j].begin(), edgesample[j].end(), -1);
+			}
+			edgemap = std::vector<float>(2 * sfm + 1);
+			cnt = std::vector<int>(2 * sfm + 1);
+
+			//Remove cradle edge
+			for (int j = sample.start; j <= sample.end; j++){
+				int mid = p1v[j - sample.start];
+				int lpmin = std::max(p1v[j - sample.start] - sfm, 0);
+				int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.cols - 1);
+				for (int l = lpmin; l <= lpmax; l++){
+					if ((mask.at<char>(j, l) & (V_MASK | DEFECT)) == 0){
+						edgesample[mid - l + sfm][j - sample.start] = filtered.at<float>(j, l);
+						cnt[mid - l + sfm]++;
 					}
 				}
-				else{
-					if (lin_model_midu[1] < 0.9){
-						lin_model_midu[0] = lin_model_midl[0];
-						lin_model_midu[1] = lin_model_midl[1];
-					}
-					if (lin_model_midl[1] < 0.9){
-						lin_model_midl[0] = lin_model_midu[0];
-						lin_model_midl[1] = lin_model_midu[1];
-					}
+			}
+			for (int j = 0; j < edgemap.size(); j++){
+				if (cnt[j] != 0){
+					edgemap[j] = getMedian(edgesample[j]);
 				}
+			}
+			first = 0;
+			while (first < edgemap.size() && cnt[first] == 0) first++;
+			last = edgemap.size() - 1;
+			while (last >= 0 && cnt[last] == 0) last--;
 
-				//Save out fitted model for later usage
-				hm[i][s] = std::vector<float>(5);
-				hm[i][s][0] = lin_model_midu[0];
-				hm[i][s][1] = lin_model_midu[1];
-				hm[i][s][2] = lin_model_midl[0];
-				hm[i][s][3] = lin_model_midl[1];
-				hm[i][s][4] = (sample.end + sample.start) / 2;
+			//Find proper edge of the cradle
+			separation = first;
+			minv = edgemap[first];
+			maxv = edgemap[first];
+			for (int j = first; j < last; j++){
+				if (edgemap[j] < minv)
+					minv = edgemap[j];
+				if (edgemap[j] > maxv)
+					maxv = edgemap[j];
+			}
+			while (edgemap[separation] >(minv + maxv) / 2){
+				separation++;
+			}
+			
+			if (first < last){
 
-				//Remove intensity from middle of cradle based on interpolation of the two edge profiles
-				std::vector<int> p1v(sample.end - sample.start + 1), p2v(sample.end - sample.start + 1);
+				//Remove edge
 				for (int j = sample.start; j <= sample.end; j++){
+					//Adjust sampled edgemap
+					int mid, lpmin, lpmax;
 
-					//Find start/end of cradle part
-					int p1, p2;
-					p1 = p2 = midpos[i][j];
+					int bk = 0;
+					float mcost = 1e20;
 
-					while (p1 > 0 && (mask.at<char>(p1, j) & H_MASK) == H_MASK)
-						p1--;
-					while (p2 < mask.rows - 1 && (mask.at<char>(p2, j) & H_MASK) == H_MASK)
-						p2++;
-
-					p1v[j - sample.start] = p1;
-					p2v[j - sample.start] = p2;
+					//Find position that best fits the edge
+					for (int k = -step; k <= step; k++){
+						int lpmin = std::max(p1v[j - sample.start] - sfm, 0);
+						int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.cols - 1);
+						int mid = p1v[j - sample.start];
+						int c = 0;
+						float cost = 0;
 
-					int start = std::max(0, p1 - sfm);
-					int end = std::min(img.rows - 1, p2 + sfm);
 
-					//Remove intensity from middle of cradle based on interpolation of the two edge profiles
-					for (int k = p1 + sfm / 2; k < p2 - sfm / 2; k++){
-						if (((mask.at<char>(k, j)) & (V_MASK | DEFECT)) == 0){
-							float pv = img.at<float>(k, j);
+						float edgemean = 0;
+						float samplemean = 0;
+						//Get means of the two edge profiles
+						for (int l = lpmin; l < lpmax; l++){
+							int pos = mid - l + sfm + k;
+							if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (V_MASK | DEFECT)) == 0)){
+								samplemean += filtered.at<float>(j, l);
+								edgemean += edgemap[pos];
+								c++;
+							}
+						}
 
-							//Get the two estimations based on the edge profiles
-							float epv1 = lin_model_midu[1] * pv + lin_model_midu[0];
-							float epv2 = lin_model_midl[1] * pv + lin_model_midl[0];
+						samplemean /= c;
+						edgemean /= c;
 
-							//Take weighted average of approximations
-							float iv = (k - p1 - sfm) * 1.0 / (p2 - p1 - 2 * sfm)*(epv2 - epv1) + epv1;
+						//Check how well it fits
+						for (int l = lpmin; l < lpmax; l++){
+							int pos = mid - l + sfm + k;
+							if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (V_MASK | DEFECT)) == 0)){
+								if (cnt[pos] != 0){
+									float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(j, l) - samplemean);
+									cost += tmp*tmp;
+								}
+							}
+						}
+						cost /= c;
 
-							ms.piece_mask.at<ushort>(k, j) = ms.pieces;
-							cradle.at<float>(k, j) = pv - iv;
-							mask.at<char>(k, j) |= H_MASK;
+						if (cost < mcost){
+							mcost = cost;
+							bk = k;
 						}
 					}
-				}
 
-				std::vector<float> edgemap;
-				std::vector<std::vector<float>> edgesample;
-				std::vector<int> cnt;
-				float minv, maxv;
-				int first, last, separation;
-				int step = std::min(3, std::max(sfm / 5, 1));
+					//Remove intensity
+					lpmin = std::max(p1v[j - sample.start] - sfm, 0);
+					lpmax = std::min(p1v[j - sample.start] + sfm, filtered.cols - 1);
+					mid = p1v[j - sample.start];
 
-				//Remove edge - upper
-				edgesample = std::vector<std::vector<float>>(2 * sfm + 1);
-				for (int j = 0; j < edgesample.size(); j++){
-					edgesample[j] = std::vector<float>(sample.end - sample.start + 1);
-					std::fill(edgesample[j].begin(), edgesample[j].end(), -1);
-				}
-				edgemap = std::vector<float>(2 * sfm + 1);
-				cnt = std::vector<int>(2 * sfm + 1);
+					float ref = lin_model_midu[1] * filtered.at<float>(j, lpmax) + lin_model_midu[0];
+					float dif = filtered.at<float>(j, lpmax) - ref;
 
-				//Remove cradle edge
-				for (int j = sample.start; j <= sample.end; j++){
-					int mid = p1v[j - sample.start];
-					int lpmin = std::max(p1v[j - sample.start] - sfm, 0);
-					int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.rows - 1);
-					for (int l = lpmin; l <= lpmax; l++){
-						if ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0){
-							edgesample[mid - l + sfm][j - sample.start] = filtered.at<float>(l, j);
-							cnt[mid - l + sfm]++;
+					float a, b;
+					//Check if the edge is dropping or is just flat cradle
+					if (std::abs(edgemap[last] - edgemap[first]) < std::abs(dif) *0.5){
+						//Flat cradle, no edge
+						a = 0;
+						b = dif;
+					}
+					else{
+						//Regular decaying edge
+						a = dif / (edgemap[first] - edgemap[last]);
+						b = dif - a * edgemap[first];
+					}
+
+					for (int l = lpmin; l < lpmax; l++){
+						int pos = mid - l + sfm + bk;
+						if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (V_MASK | DEFECT)) == 0)){
+							cradle.at<float>(j, l) = a*edgemap[pos] + b;
+							written.at<uchar>(j, l) |= TILE_CRADLE;
+							if (pos <= separation){
+								addLabel(segs, j, r0 + l, id);
+							}
 						}
 					}
 				}
-				for (int j = 0; j < edgemap.size(); j++){
-					if (cnt[j] != 0){
-						edgemap[j] = getMedian(edgesample[j]);
+			}
+
+			//Remove edge - lower
+			edgemap = std::vector<float>(2 * sfm + 1);
+			cnt = std::vector<int>(2 * sfm + 1);
+
+			//Model cradle edge
+			for (int j = sample.start; j <= sample.end; j++){
+				int mid = p2v[j - sample.start];
+				int lpmin = std::max(p2v[j - sample.start] - sfm, 0);
+				int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.cols - 1);
+				for (int l = lpmin; l <= lpmax; l++){
+					if ((mask.at<char>(j, l) & (V_MASK | DEFECT)) == 0){
+						edgemap[mid - l + sfm] += filtered.at<float>(j, l);
+						cnt[mid - l + sfm]++;
 					}
 				}
-				first = 0;
-				while (first < edgemap.size() && cnt[first] == 0) first++;
-				last = edgemap.size() - 1;
-				while (last >= 0 && cnt[last] == 0) last--;
-
-				//Find proper edge of the cradle
-				separation = first;
-				minv = edgemap[first];
-				maxv = edgemap[first];
-				for (int j = first; j < last; j++){
-					if (edgemap[j] < minv)
-						minv = edgemap[j];
-					if (edgemap[j] > maxv)
-						maxv = edgemap[j];
-				}
-				while (edgemap[separation] >(minv + maxv) / 2){
-					separation++;
-				}
-				
-				if (first < last){
-
-					//Remove edge
-					for (int j = sample.start; j <= sample.end; j++){
-						//Adjust sampled edgemap
-						int mid, lpmin, lpmax;
-
-						int bk = 0;
-						float mcost = 1e20;
-
-						//Find position that best fits the edge
-						for (int k = -step; k <= step; k++){
-							int lpmin = std::max(p1v[j - sample.start] - sfm, 0);
-							int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.rows - 1);
-							int mid = p1v[j - sample.start];
-							int c = 0;
-							float cost = 0;
-
-
-							float edgemean = 0;
-							float samplemean = 0;
-							//Get means of the two edge profiles
-							for (int l = lpmin; l < lpmax; l++){
-								int pos = mid - l + sfm + k;
-								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0)){
-									samplemean += filtered.at<float>(l, j);
-									edgemean += edgemap[pos];
-									c++;
-								}
-							}
+			}
+			for (int j = 0; j < edgemap.size(); j++){
+				if (cnt[j] != 0){
+					edgemap[j] /= cnt[j];
+				}
+			}
 
-							samplemean /= c;
-							edgemean /= c;
-
-							//Check how well it fits
-							for (int l = lpmin; l < lpmax; l++){
-								int pos = mid - l + sfm + k;
-								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0)){
-									if (cnt[pos] != 0){
-										float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(l, j) - samplemean);
-										cost += tmp*tmp;
-									}
-								}
-							}
-							cost /= c;
+			first = 0;
+			while (first < edgemap.size() && cnt[first] == 0) first++;
+			last = edgemap.size() - 1;
+			while (last >= 0 && cnt[last] == 0) last--;
+			
+			//Find proper edge of the cradle
+			separation = last - 1;
+			minv = edgemap[separation];
+			maxv = edgemap[separation];
+			for (int j = first; j < last; j++){
+				if (edgemap[j] < minv)
+					minv = edgemap[j];
+				if (edgemap[j] > maxv)
+					maxv = edgemap[j];
+			}
+			while (edgemap[separation] >(minv + maxv) / 2){
+				separation--;
+			}
 
-							if (cost < mcost){
-								mcost = cost;
-								bk = k;
-							}
-						}
+			if (first < last){
 
-						//Remove intensity
-						lpmin = std::max(p1v[j - sample.start] - sfm, 0);
-						lpmax = std::min(p1v[j - sample.start] + sfm, filtered.rows - 1);
-						mid = p1v[j - sample.start];
+				//Remove edge
+				for (int j = sample.start; j <= sample.end; j++){
+					int bk = 0;
+					float mcost = 1e20;
 
-						float ref = lin_model_midu[1] * filtered.at<float>(lpmax, j) + lin_model_midu[0];
-						float dif = filtered.at<float>(lpmax, j) - ref;
+					//Find position that best fits the edge
+					for (int k = -step; k <= step; k++){
+						int lpmin = std::max(p2v[j - sample.start] - sfm, 0);
+						int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.cols - 1);
+						int mid = p2v[j - sample.start];
+						int c = 0;
+						float cost = 0;
 
-						float a, b;
-						//Check if the edge is dropping or is just flat cradle
-						if (std::abs(edgemap[last] - edgemap[first]) < std::abs(dif) *0.5){
-							//Flat cradle, no edge
-							a = 0;
-							b = dif;
-						}
-						else{
-							//Regular decaying edge
-							a = dif / (edgemap[first] - edgemap[last]);
-							b = dif - a * edgemap[first];
+						float edgemean = 0;
+						float samplemean = 0;
+						//Get means of the two edge profiles
+						for (int l = lpmin; l < lpmax; l++){
+							int pos = mid - l + sfm + k;
+							if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (V_MASK | DEFECT)) == 0)){
+								samplemean += filtered.at<float>(j, l);
+								edgemean += edgemap[pos];
+								c++;
+							}
 						}
 
+						samplemean /= c;
+						edgemean /= c;
+
+						//Check how well it fits
 						for (int l = lpmin; l < lpmax; l++){
-							int pos = mid - l + sfm + bk;
-							if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0)){
-								cradle.at<float>(l, j) = a*edgemap[pos] + b;
-								if (pos <= separation){
-									ms.piece_mask.at<ushort>(l, j) = ms.pieces;
+							int pos = mid - l + sfm + k;
+							if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (V_MASK | DEFECT)) == 0)){
+								if (edgemap[pos] != 0){
+									float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(j, l) - samplemean);
+									cost += tmp*tmp;
 								}
 							}
 						}
-					}
-				}
+						cost /= c;
 
-				//Remove edge - lower
-				edgemap = std::vector<float>(2 * sfm + 1);
-				cnt = std::vector<int>(2 * sfm + 1);
+						if (cost < mcost){
+							mcost = cost;
+							bk = k;
+						}
+					}
 
-				//Model cradle edge
-				for (int j = sample.start; j <= sample.end; j++){
-					int mid = p2v[j - sample.start];
+					//Remove intensity
 					int lpmin = std::max(p2v[j - sample.start] - sfm, 0);
-					int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.rows - 1);
-					for (int l = lpmin; l <= lpmax; l++){
-						if ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0){
-							edgemap[mid - l + sfm] += filtered.at<float>(l, j);
-							cnt[mid - l + sfm]++;
-						}
+					int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.cols - 1);
+					int mid = p2v[j - sample.start];
+
+					float ref = lin_model_midl[1] * filtered.at<float>(j, lpmin) + lin_model_midl[0]; //filtered.at<float>(j, lpmax);
+					float dif = filtered.at<float>(j, lpmin) - ref;
+					float a, b;
+
+					//Check if the edge is dropping or is just flat cradle
+					if (std::abs(edgemap[last] - edgemap[first]) < std::abs(dif) *0.5){
+						//Flat cradle, no edge
+						a = 0;
+						b = dif;
 					}
-				}
-				for (int j = 0; j < edgemap.size(); j++){
-					if (cnt[j] != 0){
-						edgemap[j] /= cnt[j];
+					else{
+						//Regular decaying edge
+						a = dif / (edgemap[last] - edgemap[first]);
+						b = dif - a * edgemap[last];
 					}
-				}
 
-				first = 0;
-				while (first < edgemap.size() && cnt[first] == 0) first++;
-				last = edgemap.size() - 1;
-				while (last >= 0 && cnt[last] == 0) last--;
-				
-				//Find proper edge of the cradle
-				separation = last - 1;
-				minv = edgemap[separation];
-				maxv = edgemap[separation];
-				for (int j = first; j < last; j++){
-					if (edgemap[j] < minv)
-						minv = edgemap[j];
-					if (edgemap[j] > maxv)
-						maxv = edgemap[j];
-				}
-				while (edgemap[separation] >(minv + maxv) / 2){
-					separation--;
-				}
-
-				if (first < last){
-
-					//Remove edge
-					for (int j = sample.start; j <= sample.end; j++){
-						int bk = 0;
-						float mcost = 1e20;
-
-						//Find position that best fits the edge
-						for (int k = -step; k <= step; k++){
-							int lpmin = std::max(p2v[j - sample.start] - sfm, 0);
-							int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.rows - 1);
-							int mid = p2v[j - sample.start];
-							int c = 0;
-							float cost = 0;
-
-							float edgemean = 0;
-							float samplemean = 0;
-							//Get means of the two edge profiles
-							for (int l = lpmin; l < lpmax; l++){
-								int pos = mid - l + sfm + k;
-								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0)){
-									samplemean += filtered.at<float>(l, j);
-									edgemean += edgemap[pos];
-									c++;
-								}
+					for (int l = lpmin; l < lpmax; l++){
+						int pos = mid - l + sfm + bk;
+						if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (V_MASK | DEFECT)) == 0)){
+							cradle.at<float>(j, l) = a*edgemap[pos] + b;
+							written.at<uchar>(j, l) |= TILE_CRADLE;
+							if (pos >= separation){
+								addLabel(segs, j, r0 + l, id);
 							}
+						}
+					}
+				}
+			}
+		}
+	}
 
-							samplemean /= c;
-							edgemean /= c;
-
-							//Check how well it fits
-							for (int l = lpmin; l < lpmax; l++){
-								int pos = mid - l + sfm + k;
-								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0)){
-									if (edgemap[pos] != 0){
-										float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(l, j) - samplemean);
-										cost += tmp*tmp;
-									}
-								}
-							}
-							cost /= c;
+	//Remove horizontal cradle piece i, its segments and labeled pixels are recorded in 'segs'; returns false if its middle line is invalid.
+	//Column walks are slow on large images, so the piece is processed on a transposed copy of the rows it reaches
+	static bool removeHorizontalPiece(
+		int i,												//Index of the horizontal cradle piece
+		const cv::Mat &img,									//Input grayscale float X-ray image
+		const cv::Mat &filtered,							//Directionally smoothed input image
+		cv::Mat &mask,										//Mask containing marked horizontal and/or vertical cradle positions
+		cv::Mat &cradle,									//Cradle component after separation saved out here
+		std::vector<std::vector<int>> &midpos_points,		//Center of horizontal cradle pieces
+		std::vector<int> &s,								//Width of horizontal cradle pieces
+		std::vector<std::vector<float>> &hmi,				//Saves out parameters of the fitted multiplicative model of the piece
+		PieceSegments &segs									//Segments of the piece
+	){
+		//Set adaptively value of s
+		int sfm = s[i] * 0.1;
+
+		//Create midpos vector (interpolate two points for all columns)
+		std::vector<int> midpos(img.cols);
+		int x1 = midpos_points[i][0];
+		int y1 = midpos_points[i][1];
+		int x2 = midpos_points[i][2];
+		int y2 = midpos_points[i][3];
+
+		if (x2 == x1){
+			//This is a vertical line -> invalid for a horizontal cradle piece
+			return false; //Stuff went wrong
+		}
+		else{
+			float m = (y2 - y1) * 1.0 / (x2 - x1);
+			//Fill up midpoints
+			for (int j = 0; j < img.cols; j++){
+				midpos[j] = m * (j - x1) + y1;
+			}
+		}
 
-							if (cost < mcost){
-								mcost = cost;
-								bk = k;
-							}
-						}
+		//Rows reached by the piece: its marked part (as walked by the kernel) and the sampling margins around it
+		int r0 = img.rows, r1 = 0;
+		for (int j = 0; j < img.cols; j++){
+			int p1, p2;
+			p1 = p2 = midpos[j];
 
-						//Remove intensity
-						int lpmin = std::max(p2v[j - sample.start] - sfm, 0);
-						int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.rows - 1);
-						int mid = p2v[j - sample.start];
+			while (p1 > 0 && (mask.at<char>(p1, j) & H_MASK) == H_MASK)
+				p1--;
+			while (p2 < mask.rows - 1 && (mask.at<char>(p2, j) & H_MASK) == H_MASK)
+				p2++;
 
-						float ref = lin_model_midl[1] * filtered.at<float>(lpmin, j) + lin_model_midl[0]; //filtered.at<float>(lpmax, j);
-						float dif = filtered.at<float>(lpmin, j) - ref;
-						float a, b;
+			r0 = std::min(r0, p1);
+			r1 = std::max(r1, p2);
+		}
+		r0 = std::max(0, r0 - 2 * sfm - 1);
+		r1 = std::min(img.rows, r1 + 2 * sfm + 2);
+		for (int j = 0; j < img.cols; j++){
+			midpos[j] -= r0;
+		}
 
-						//Check if the edge is dropping or is just flat cradle
-						if (std::abs(edgemap[last] - edgemap[first]) < std::abs(dif) *0.5){
-							//Flat cradle, no edge
-							a = 0;
-							b = dif;
-						}
-						else{
-							//Regular decaying edge
-							a = dif / (edgemap[last] - edgemap[first]);
-							b = dif - a * edgemap[last];
-						}
+		//Run the kernel on a transposed copy of the band and transpose the results back
+		cv::Mat imgt, filteredt, maskt, cradlet;
+		transposeTile<float>(img.rowRange(r0, r1), imgt);
+		transposeTile<float>(filtered.rowRange(r0, r1), filteredt);
+		transposeTile<uchar>(mask.rowRange(r0, r1), maskt);
+		transposeTile<float>(cradle.rowRange(r0, r1), cradlet);
+
+		cv::Mat writtent(imgt.rows, imgt.cols, CV_8U, cv::Scalar(0));
+		segs.columns = true;
+		removeHorizontalTile(imgt, filteredt, maskt, cradlet, writtent, midpos, r0, sfm, hmi, segs);
+
+		//Only the pixels written by the kernel go back, the bands of pieces processed in parallel may overlap
+		for (int j = 0; j < writtent.rows; j++){
+			const uchar *wp = writtent.ptr<uchar>(j);
+			for (int k = 0; k < writtent.cols; k++){
+				if (wp[k] == 0)
+					continue;
+				if (wp[k] & TILE_CRADLE)
+					cradle.at<float>(r0 + k, j) = cradlet.at<float>(j, k);
+				if (wp[k] & TILE_MASK)
+					mask.at<char>(r0 + k, j) |= H_MASK;
+			}
+		}
 
-						for (int l = lpmin; l < lpmax; l++){
-							int pos = mid - l + sfm + bk;
-							if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0)){
-								cradle.at<float>(l, j) = a*edgemap[pos] + b;
-								if (pos >= separation){
-									ms.piece_mask.at<ushort>(l, j) = ms.pieces;
-								}
-							}
-						}
-					}
+		return true;
+	}
+
+	//Remove horizontal cradle pieces and save out correction model used for later usage
+	void removeHorizontal(
+		const cv::Mat &img,									//Input grayscale float X-ray image
+		cv::Mat &mask,										//Mask containing marked horizontal and/or vertical cradle positions
+		cv::Mat &cradle,									//Cradle component after separation saved out here
+		std::vector<std::vector<int>> &midpos_points,		//Center of horizontal cradle pieces
+		std::vector<int> s,									//Width of horizontal cradle pieces
+		std::vector<std::vector<std::vector<float>>> &hm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
+		MarkedSegments &ms									//MarkedSegment structure will contain processing information
+	){
+
+		//Set avg_s as a function of the average cradle-piece thickness
+		float avg = 0;
+		int avg_s;
+		for (int i = 0; i < s.size(); i++){
+			avg += s[i];
+		}
+		avg /= s.size();
+		avg_s = std::max(3, (int)(avg * 0.2));
+
+		//Directional smoothing of image
+		cv::Mat smooth, filtered;
+		smooth = cv::Mat(1, avg_s, CV_32F, cv::Scalar(1.0 / avg_s));
+		cv::filter2D(img, filtered, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
+
+		int vtot = midpos_points.size();	//Total number of horizontal pieces
+		hm = std::vector<std::vector<std::vector<float>>>(vtot);
+
+		//Cover all horizontal cradles
+		removePieces(validPieces(midpos_points), ms, [&](int i, PieceSegments &segs){
+			return removeHorizontalPiece(i, img, filtered, mask, cradle, midpos_points, s, hm[i], segs);
+		}, [&](int i, const PieceSegments &segs){
+			return commitSegments(ms, segs, HORIZONTAL_DIR, &ms.pieceIDh[i], NULL);
+		});
+	}
+
+	//Creates an empty bit mask of the given size
+	BitMask createBitMask(int rows, int cols){
+		BitMask bm;
+		bm.rows = rows;
+		bm.cols = cols;
+		bm.stride = (cols + 63) / 64;
+		bm.bits = std::vector<std::uint64_t>((size_t)rows * bm.stride, 0);
+		return bm;
+	}
+
+	static inline bool bitTest(const BitMask &bm, int i, int j){
+		return (bm.bits[(size_t)i * bm.stride + (j >> 6)] >> (j & 63)) & 1;
+	}
+
+	static inline void bitSet(BitMask &bm, int i, int j){
+		bm.bits[(size_t)i * bm.stride + (j >> 6)] |= (std::uint64_t)1 << (j & 63);
+	}
+
+	//Row span [x0, x1] still to be scanned for fillable pixels
+	struct FillSpan{
+		int y, x0, x1;
+	};
+
+	//Scanline flood fill: marks in 'mark' every unmarked pixel of 'val' (CV_32F) smaller than th that is 4-connected,
+	//through such pixels, to one of the 4 neighbours of (i,j). Whole runs of a row are marked at once and only the
+	//spans above and below a run are queued, on an explicit stack. Returns the number of pixels marked
+	int floodFillBelow(const cv::Mat &val, float th, int i, int j, BitMask &mark){
+		int count = 0;
+		std::vector<FillSpan> stack;
+		const int ni[4] = { i - 1, i + 1, i, i };
+		const int nj[4] = { j, j, j - 1, j + 1 };
+		for (int k = 0; k < 4; k++){
+			if (ni[k] >= 0 && ni[k] < val.rows && nj[k] >= 0 && nj[k] < val.cols)
+				stack.push_back({ ni[k], nj[k], nj[k] });
+		}
+
+		while (!stack.empty()){
+			FillSpan sp = stack.back();
+			stack.pop_back();
+			if (sp.y < 0 || sp.y >= val.rows)
+				continue;
+
+			const float *row = val.ptr<float>(sp.y);
+			int x = sp.x0;
+			while (x <= sp.x1){
+				if (bitTest(mark, sp.y, x) || !(th > row[x])){
+					x++;
+					continue;
 				}
+
+				//Extend the run to both sides and mark it
+				int l = x, r = x;
+				while (l > 0 && !bitTest(mark, sp.y, l - 1) && th > row[l - 1])
+					l--;
+				while (r < val.cols - 1 && !bitTest(mark, sp.y, r + 1) && th > row[r + 1])
+					r++;
+				for (int c = l; c <= r; c++)
+					bitSet(mark, sp.y, c);
+				count += r - l + 1;
+
+				stack.push_back({ sp.y - 1, l, r });
+				stack.push_back({ sp.y + 1, l, r });
+				x = r + 2;
 			}
 		}
+		return count;
 	}
 
-	//Recursive watershed algorithm that marks all pixels of image 'val' smaller then threshold th,
+	//Watershed algorithm that marks all pixels of image 'val' smaller then threshold th,
 	//propagating from starting point (i,j), marked in binary image 'mark'
 	void watershed(int i, int j, int th, cv::Mat &val, cv::Mat &mark){
-		if (i > 0 && mark.at<float>(i - 1, j) == 0 && th > val.at<float>(i - 1, j)){
-			mark.at<float>(i - 1, j) = 1;
-			watershed(i - 1, j, th, val, mark);
-		}
-		if (i < val.rows - 1 && mark.at<float>(i + 1, j) == 0 && th > val.at<float>(i + 1, j)){
-			mark.at<float>(i + 1, j) = 1;
-			watershed(i + 1, j, th, val, mark);
-		}
-		if (j > 0 && mark.at<float>(i, j - 1) == 0 && th > val.at<float>(i, j - 1)){
-			mark.at<float>(i, j - 1) = 1;
-			watershed(i, j - 1, th, val, mark);
+		BitMask bm = createBitMask(mark.rows, mark.cols);
+		for (int y = 0; y < mark.rows; y++){
+			const float *mp = mark.ptr<float>(y);
+			for (int x = 0; x < mark.cols; x++){
+				if (mp[x] != 0)
+					bitSet(bm, y, x);
+			}
 		}
-		if (j < val.cols - 1 && mark.at<float>(i, j + 1) == 0 && th > val.at<float>(i, j + 1)){
-			mark.at<float>(i, j + 1) = 1;
-			watershed(i, j + 1, th, val, mark);
+
+		//Already marked pixels stay untouched and block the propagation
+		BitMask filled = bm;
+		if (floodFillBelow(val, (float)th, i, j, filled) == 0)
+			return;
+		for (int y = 0; y < mark.rows; y++){
+			float *mp = mark.ptr<float>(y);
+			for (int x = 0; x < mark.cols; x++){
+				if (bitTest(filled, y, x) && !bitTest(bm, y, x))
+					mp[x] = 1;
+			}
 		}
 	}
 
-	//Function returns a value 'alpha' that approximately minimizes the optimization problem
+	//Function returns the value 'alpha' in [0, 1] that minimizes the optimization problem
 	// alpha = arg min (Var[img - alpha * (cradle .* mark)])
-	// where .* denotes a pixel-wise product of two images
-	float findAlpha(cv::Mat &img, cv::Mat &cradle, cv::Mat &mark){
-		float ba, minv, step;
-		cv::Mat rec(cradle.rows, cradle.cols, CV_32F, cv::Scalar(0));
+	// where .* denotes a pixel-wise product of two images (the cradle is subtracted fully outside of the mark).
+	//With u = img - cradle .* (1 - mark) and w = cradle .* mark the cost is Var[u] - 2 alpha Cov[u, w] + alpha^2 Var[w],
+	//so the minimum is at Cov[u, w] / Var[w], clamped to [0, 1]. The moments are collected in a single pass
+	float findAlpha(cv::Mat &img, cv::Mat &cradle, const BitMask &mark){
+		double su = 0, sw = 0, suw = 0, sww = 0;
+		double n = (double)cradle.rows * cradle.cols;
+		if (n == 0)
+			return 0;
 
 		for (int i = 0; i < cradle.rows; i++){
+			const float *ip = img.ptr<float>(i);
+			const float *cp = cradle.ptr<float>(i);
 			for (int j = 0; j < cradle.cols; j++){
-				if (mark.at<float>(i, j) == 0)
-					rec.at<float>(i, j) = cradle.at<float>(i, j);
+				double u = ip[j];
+				double w = 0;
+				if (!bitTest(mark, i, j))
+					u -= cp[j];
 				else
-					rec.at<float>(i, j) = 0;
+					w = cp[j];
+				su += u;
+				sw += w;
+				suw += u * w;
+				sww += w * w;
 			}
 		}
-		minv = getVariance(img - rec);
-		ba = 0;
-		step = 0.1;
 
-		for (float alpha = step; alpha <= 1; alpha += step){
-			//Fill up weighted
-			for (int i = 0; i < cradle.rows; i++){
-				for (int j = 0; j < cradle.cols; j++){
-					if (mark.at<float>(i, j) == 0)
-						rec.at<float>(i, j) = cradle.at<float>(i, j);
-					else
-						rec.at<float>(i, j) = alpha * cradle.at<float>(i, j);
+		double cov = suw / n - (su / n) * (sw / n);
+		double var = sww / n - (sw / n) * (sw / n);
+
+		//Cost does not depend on alpha
+		if (var <= 0)
+			return 0;
+		return std::min(1.0, std::max(0.0, cov / var));
+	}
+
+	//Returns the odd box width w in [3, wmax) for which Var[img - blur(mark, w x w)] is the lowest (3 if the range is empty).
+	//All widths are evaluated from one integral image of the mark, padded like cv::blur pads (BORDER_DEFAULT), so each
+	//box mean is read in O(1) without building the blurred image
+	static int bestSmoothingWidth(const cv::Mat &img, const cv::Mat &mark, int wmax){
+		int bestv = 3;
+		if (wmax <= 3 || mark.empty())
+			return bestv;
+
+		int rmax = (wmax - 2) / 2;
+		cv::Mat padded, sum;
+		cv::copyMakeBorder(mark, padded, rmax, rmax, rmax, rmax, cv::BORDER_DEFAULT);
+		cv::integral(padded, sum, CV_64F);
+
+		//Residuals are accumulated around a shift to keep the one-pass variance accurate
+		double n = (double)mark.rows * mark.cols;
+		double shift = img.at<float>(0, 0) - mark.at<float>(0, 0);
+		double minv = -1;
+		for (int w = 3; w < wmax; w += 2){
+			int r = w / 2;
+			double norm = 1.0 / ((double)w * w);
+			double s = 0, s2 = 0;
+			for (int y = 0; y < mark.rows; y++){
+				const double *top = sum.ptr<double>(y + rmax - r);
+				const double *bot = sum.ptr<double>(y + rmax + r + 1);
+				const float *ip = img.ptr<float>(y);
+				for (int x = 0; x < mark.cols; x++){
+					int x0 = x + rmax - r;
+					int x1 = x + rmax + r + 1;
+					double d = ip[x] - (bot[x1] - bot[x0] - top[x1] + top[x0]) * norm - shift;
+					s += d;
+					s2 += d * d;
 				}
 			}
 
-			//Check if lower variance
-			float cost = getVariance(img - rec);
-			if (cost < minv){
-				ba = alpha;
-				minv = cost;
+			double var = s2 / n - (s / n) * (s / n);
+			if (minv == -1 || var < minv){
+				minv = var;
+				bestv = w;
 			}
 		}
-		return ba;
+		return bestv;
 	}
 
 	//Function responsable for detecting and correcting, when possible, for overcorrections in border areas
@@ -2144,50 +2589,17 @@ namespace CradleFunctions{
 		}
 
 		//Watershed for marking where we adopt the cradle mask
-		cv::Mat mark(rec.rows, rec.cols, CV_32F, cv::Scalar(0));
-		std::vector<int> vx(rec.rows*rec.cols), vy(rec.rows*rec.cols);
-		int start = 0, end = 1;
-		float th = 0;
-		vx[0] = px;
-		vy[0] = py;
-
-		while (start < end){
-			int i = vx[start];
-			int j = vy[start];
-			if (i > 0 && mark.at<float>(i - 1, j) == 0 && th > rec.at<float>(i - 1, j)){
-				mark.at<float>(i - 1, j) = 1;
-				vx[end] = i - 1;
-				vy[end] = j;
-				end++;
-			}
-			if (i < rec.rows - 1 && mark.at<float>(i + 1, j) == 0 && th > rec.at<float>(i + 1, j)){
-				mark.at<float>(i + 1, j) = 1;
-				vx[end] = i + 1;
-				vy[end] = j;
-				end++;
-			}
-			if (j > 0 && mark.at<float>(i, j - 1) == 0 && th > rec.at<float>(i, j - 1)){
-				mark.at<float>(i, j - 1) = 1;
-				vx[end] = i;
-				vy[end] = j - 1;
-				end++;
-			}
-			if (j < rec.cols - 1 && mark.at<float>(i, j + 1) == 0 && th > rec.at<float>(i, j + 1)){
-				mark.at<float>(i, j + 1) = 1;
-				vx[end] = i;
-				vy[end] = j + 1;
-				end++;
-			}
-			start++;
-		}
+		BitMask region = createBitMask(rec.rows, rec.cols);
+		floodFillBelow(rec, 0, px, py, region);
 
 		cv::Mat cradleseg = cradle(cv::Range(stx, enx), cv::Range(sty, eny));
 		cv::Mat imgseg = img(cv::Range(stx, enx), cv::Range(sty, eny));
-		float alpha = findAlpha(imgseg, cradleseg, mark);
+		float alpha = findAlpha(imgseg, cradleseg, region);
 
+		cv::Mat mark(rec.rows, rec.cols, CV_32F);
 		for (int i = stx; i < enx; i++){
 			for (int j = sty; j < eny; j++){
-				if (mark.at<float>(i - stx, j - sty) == 0){
+				if (!bitTest(region, i - stx, j - sty)){
 					mark.at<float>(i - stx, j - sty) = cradle.at<float>(i, j);
 				}
 				else{
@@ -2197,22 +2609,7 @@ namespace CradleFunctions{
 		}
 
 		//Find ideal smoothing amount
-		float minv = -1;
-		int bestv = 3;
-		for (int i = 3; i < 2 * wb; i += 2){
-			cv::Mat bmark, check;
-			cv::blur(mark, bmark, cv::Size(i, i));
-			check = imgseg - bmark;
-
-			float var = getVariance(check);
-			if (minv == -1){
-				minv = var;
-			}
-			if (var < minv){
-				minv = var;
-				bestv = i;
-			}
-		}
+		int bestv = bestSmoothingWidth(imgseg, mark, 2 * wb);
 
 		//Blur it a bit to remove edge artifacts
 		cv::blur(mark, mark, cv::Size(bestv, bestv));
@@ -2226,58 +2623,270 @@ namespace CradleFunctions{
 		return;
 	}
 
-	//Randon transform used to find cradle tilting angle
-	std::vector<double> findRadonTransformAngle(const cv::Mat &img, cv::Mat &mask, std::vector<double> &thetav, int sx, int ex, int sy, int ey, int noflag){
-		int W = (ey - sy), H = (ex - sx);
-		int maxv = (int)(std::sqrt(W*W + H*H)) + 1;
-		double center_x = sy + W / 2;
-		double center_y = sx + H / 2;
-		cv::Mat acc(2 * maxv, thetav.size(), CV_32F, cv::Scalar(0));
-
-		//Calculate Radon transform
-		for (int y = sx; y < sx + H; y++){
-			for (int x = sy; x < sy + W; x++){
-				if (y >= 0 && y < mask.rows && x >= 0 && x < mask.cols && ((mask.at<char>(y, x) & noflag) == 0)){
-					for (int i = 0; i < thetav.size(); i++){
-						double theta = thetav[i];
-						if (theta < 0)
-							theta += 360;
-						if (theta > 360)
-							theta -= 360;
-						int r = (x - center_x) *1.0 * cos(RAD(theta)) - (y - center_y) *1.0 * sin(RAD(theta));
-						acc.at<float>((r + maxv), i) = acc.at<float>((r + maxv), i) + (img).at<float>(y, x);
+	//Band area x number of angles above which the Radon projections are computed with the Fourier-slice backend
+	static const double fourier_radon_work = 1e9;
+
+	//Geometry of a Radon transform band
+	struct RadonBand{
+		int y0, y1, x0, x1;				//Part of the band inside the image
+		double center_x, center_y;		//Origin of the projections
+		int maxv;						//Projection offsets are in [-maxv, maxv)
+	};
+
+	//Direct accumulation of the projections
+	static void radonDirect(const cv::Mat &img, const cv::Mat &mask, const RadonBand &band, const std::vector<double> &cost, const std::vector<double> &sint, int noflag, std::vector<float> &acc){
+		int T = cost.size(), R = 2 * band.maxv, maxv = band.maxv;
+
+		//Accumulators are stored angle by angle; a block of angles is processed by a single thread,
+		//sweeping the band once and updating all angles of the block for each pixel
+		const int block = 16;
+		int nblocks = (T + block - 1) / block;
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int b = 0; b < nblocks; b++){
+			int t0 = b * block, t1 = std::min(T, t0 + block);
+			float *bacc = &acc[(size_t)t0 * R];
+			const double *bc = &cost[t0];
+			const double *bs = &sint[t0];
+			int n = t1 - t0;
+
+			for (int y = band.y0; y < band.y1; y++){
+				const char *mrow = mask.ptr<char>(y);
+				const float *irow = img.ptr<float>(y);
+				double dy = (y - band.center_y) * 1.0;
+				for (int x = band.x0; x < band.x1; x++){
+					if ((mrow[x] & noflag) == 0){
+						double dx = (x - band.center_x) * 1.0;
+						float v = irow[x];
+
+						//Each angle has its own accumulator row, so the angles can be updated in parallel lanes
+						#pragma omp simd
+						for (int i = 0; i < n; i++){
+							int r = dx * bc[i] - dy * bs[i];
+							bacc[(size_t)i * R + r + maxv] += v;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	//Weights of the 4 samples around t (0 <= t < 1) for cubic convolution interpolation (Keys, a = -0.5)
+	static inline void keysWeights(double t, double *w){
+		double t2 = t * t, t3 = t2 * t;
+		w[0] = -0.5 * t3 + t2 - 0.5 * t;
+		w[1] = 1.5 * t3 - 2.5 * t2 + 1;
+		w[2] = -1.5 * t3 + 2 * t2 + 0.5 * t;
+		w[3] = 0.5 * t3 - 0.5 * t2;
+	}
+
+	//Fourier-slice projections: the 1-D spectrum of the projection at angle theta is the slice of the 2-D spectrum of
+	//the band along theta, so after one 2-D FFT each angle costs an interpolated slice and a 1-D inverse FFT
+	static void radonFourier(const cv::Mat &img, const cv::Mat &mask, const RadonBand &band, const std::vector<double> &cost, const std::vector<double> &sint, int noflag, std::vector<float> &acc){
+		int T = cost.size(), R = 2 * band.maxv, maxv = band.maxv;
+		int Hc = band.y1 - band.y0, Wc = band.x1 - band.x0;
+
+		//Spectrum of the masked band, zero padded to twice its size so that it can be interpolated
+		//The band is stored around the origin (wrapped), which keeps the spectrum smooth between samples
+		int Ph = cv::getOptimalDFTSize(2 * Hc), Pw = cv::getOptimalDFTSize(2 * Wc);
+		int gy = (band.y0 + band.y1) / 2, gx = (band.x0 + band.x1) / 2;
+		cv::Mat padded(Ph, Pw, CV_32F, cv::Scalar(0));
+		for (int y = band.y0; y < band.y1; y++){
+			const char *mrow = mask.ptr<char>(y);
+			const float *irow = img.ptr<float>(y);
+			float *prow = padded.ptr<float>((y - gy + Ph) % Ph);
+			for (int x = band.x0; x < band.x1; x++){
+				if ((mrow[x] & noflag) == 0){
+					prow[(x - gx + Pw) % Pw] = irow[x];
+				}
+			}
+		}
+		cv::Mat F;
+		cv::dft(padded, F, cv::DFT_COMPLEX_OUTPUT);
+		padded.release();
+
+		//Projections are periodic with period Q, which covers all offsets
+		int Q = cv::getOptimalDFTSize(R);
+		double ox = gx - band.center_x, oy = gy - band.center_y;
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < T; i++){
+			cv::Mat slice(1, Q, CV_32FC2), proj;
+			float *sl = slice.ptr<float>(0);
+			double off = ox * cost[i] - oy * sint[i];
+
+			for (int k = 0; k < Q; k++){
+				double w = (k <= Q / 2 ? k : k - Q) / (double)Q;		//Frequency in cycles per pixel
+
+				//Cubic (Keys) interpolation of the spectrum (periodic) at the slice point
+				double u = w * cost[i] * Pw, v = -w * sint[i] * Ph;
+				double fu = std::floor(u), fv = std::floor(v);
+				double wu[4], wv[4];
+				keysWeights(u - fu, wu);
+				keysWeights(v - fv, wv);
+				double re = 0, im = 0;
+				for (int a = 0; a < 4; a++){
+					const float *frow = F.ptr<float>((((int)fv + a - 1) % Ph + Ph) % Ph);
+					double rr = 0, ri = 0;
+					for (int b = 0; b < 4; b++){
+						int uc = (((int)fu + b - 1) % Pw + Pw) % Pw;
+						rr += wu[b] * frow[2 * uc];
+						ri += wu[b] * frow[2 * uc + 1];
 					}
+					re += wv[a] * rr;
+					im += wv[a] * ri;
 				}
+
+				//Move the origin to the band center, and sample the projection half an offset to the right
+				double ph = -2 * M_PI * w * (off - 0.5);
+				sl[2 * k] = (float)(re * cos(ph) - im * sin(ph));
+				sl[2 * k + 1] = (float)(re * sin(ph) + im * cos(ph));
+			}
+			cv::dft(slice, proj, cv::DFT_INVERSE | cv::DFT_SCALE);
+
+			//proj(t) is the projection at t + 0.5; the direct accumulation truncates the offsets towards zero,
+			//so offset r > 0 covers [r, r + 1), r < 0 covers (r - 1, r] and 0 covers (-1, 1)
+			const float *pr = proj.ptr<float>(0);
+			float *a = &acc[(size_t)i * R];
+			for (int r = -maxv; r < maxv; r++){
+				int t = (r >= 0) ? r : r - 1;
+				a[r + maxv] = pr[2 * (((t % Q) + Q) % Q)];
 			}
+			a[maxv] += pr[2 * (Q - 1)];
+		}
+	}
+
+	//True if the Radon projections of the band for T angles are computed with the Fourier-slice backend
+	static bool radonUsesFourier(const cv::Mat &mask, int sx, int ex, int sy, int ey, int T){
+		int y0 = std::max(sx, 0), y1 = std::min(ex, mask.rows);
+		int x0 = std::max(sy, 0), x1 = std::min(ey, mask.cols);
+		if (y1 <= y0 || x1 <= x0){
+			return false;
+		}
+		return (double)(y1 - y0) * (x1 - x0) * T > fourier_radon_work;
+	}
+
+	//Radon projections of a band for a list of angles, stored angle by angle in 'acc' (2 * maxv offsets each)
+	//The direct accumulation is used for small bands, the Fourier-slice backend when band area x angles is large
+	static int radonAccumulate(const cv::Mat &img, const cv::Mat &mask, const std::vector<double> &thetav, int sx, int ex, int sy, int ey, int noflag, std::vector<float> &acc){
+		int W = (ey - sy), H = (ex - sx);
+		RadonBand band;
+		band.maxv = (int)(std::sqrt(W*W + H*H)) + 1;
+		band.center_x = sy + W / 2;
+		band.center_y = sx + H / 2;
+		int T = thetav.size();
+		int R = 2 * band.maxv;
+
+		//Trigonometric tables, one entry per angle
+		std::vector<double> cost(T), sint(T);
+		for (int i = 0; i < T; i++){
+			double theta = thetav[i];
+			if (theta < 0)
+				theta += 360;
+			if (theta > 360)
+				theta -= 360;
+			cost[i] = cos(RAD(theta));
+			sint[i] = sin(RAD(theta));
 		}
 
-		//Get squared values + sum up for each angle
-		cv::Mat sum(1, thetav.size(), CV_32F, cv::Scalar(0));
-		for (int i = 0; i < thetav.size(); i++){
-			for (int j = 0; j < 2 * maxv; j++){
-				acc.at<float>(j, i) = acc.at<float>(j, i)*acc.at<float>(j, i);
-				sum.at<float>(0, i) += acc.at<float>(j, i);
+		//Rows of the band inside the image
+		band.y0 = std::max(sx, 0);
+		band.y1 = std::min(sx + H, mask.rows);
+		band.x0 = std::max(sy, 0);
+		band.x1 = std::min(sy + W, mask.cols);
+
+		acc = std::vector<float>((size_t)T * R, 0.0f);
+		if (band.y1 <= band.y0 || band.x1 <= band.x0){
+			return band.maxv;
+		}
+		if (radonUsesFourier(mask, sx, ex, sy, ey, T)){
+			radonFourier(img, mask, band, cost, sint, noflag, acc);
+		}
+		else{
+			radonDirect(img, mask, band, cost, sint, noflag, acc);
+		}
+		return band.maxv;
+	}
+
+	//Radon transform of a band for a list of angles: sum of the squared projections (energy) and
+	//the offset of the largest projection (peak) for each angle
+	//If 'raw' is given, the projections themselves are returned in it, angle by angle (2 * maxv offsets each)
+	static int radonProjections(const cv::Mat &img, const cv::Mat &mask, const std::vector<double> &thetav, int sx, int ex, int sy, int ey, int noflag, std::vector<float> &energy, std::vector<int> &peak, std::vector<float> *raw = NULL){
+		std::vector<float> acc;
+		int maxv = radonAccumulate(img, mask, thetav, sx, ex, sy, ey, noflag, acc);
+		int T = thetav.size();
+		int R = 2 * maxv;
+
+		//Get squared values + sum up for each angle, and the position of the maxima
+		energy = std::vector<float>(T, 0.0f);
+		peak = std::vector<int>(T);
+		for (int i = 0; i < T; i++){
+			const float *a = &acc[(size_t)i * R];
+			int ind2 = 0;
+			float best = a[0] * a[0];
+			for (int j = 0; j < R; j++){
+				float sq = a[j] * a[j];
+				energy[i] += sq;
+				if (sq > best){
+					best = sq;
+					ind2 = j;
+				}
 			}
+			peak[i] = ind2 - maxv;
 		}
 
+		if (raw != NULL){
+			raw->swap(acc);
+		}
+		return maxv;
+	}
+
+	//Projection of angle i out of the angle by angle array returned by radonProjections(), as a 2 * maxv x 1 column
+	static cv::Mat projectionColumn(const std::vector<float> &raw, int i, int maxv){
+		cv::Mat col(2 * maxv, 1, CV_32F);
+		for (int j = 0; j < 2 * maxv; j++){
+			col.at<float>(j, 0) = raw[(size_t)i * 2 * maxv + j];
+		}
+		return col;
+	}
+
+	//Angle search, optionally returning the projection of the best angle
+	static std::vector<double> radonSearch(const cv::Mat &img, cv::Mat &mask, std::vector<double> &thetav, int sx, int ex, int sy, int ey, int noflag, cv::Mat *projection){
+		std::vector<float> energy, raw;
+		std::vector<int> peak;
+		bool fourier = radonUsesFourier(mask, sx, ex, sy, ey, thetav.size());
+		int maxv = radonProjections(img, mask, thetav, sx, ex, sy, ey, noflag, energy, peak, (projection != NULL && !fourier) ? &raw : NULL);
+
 		//Find best angle
 		int ind = 0;
 		for (int i = 1; i < thetav.size(); i++){
-			if (sum.at<float>(0, ind) < sum.at<float>(0, i))
+			if (energy[ind] < energy[i])
 				ind = i;
 		}
+		if (projection != NULL){
+			//Fourier-slice projections are interpolated: recompute the selected one for that angle alone, as getRadonforAngle() does
+			int col = ind;
+			if (fourier){
+				std::vector<double> best(1, thetav[ind]);
+				maxv = radonAccumulate(img, mask, best, sx, ex, sy, ey, noflag, raw);
+				col = 0;
+			}
+			*projection = projectionColumn(raw, col, maxv);
+		}
+
 		std::vector<double> res;
 		res.push_back(thetav[ind]);
+		res.push_back(peak[ind]);
+		return res;
+	}
 
-		//Find maxima for given angle
-		int ind2 = 0;
-		for (int i = 1; i < 2 * maxv; i++){
-			if (acc.at<float>(i, ind) > acc.at<float>(ind2, ind))
-				ind2 = i;
-		}
+	//Randon transform used to find cradle tilting angle
+	std::vector<double> findRadonTransformAngle(const cv::Mat &img, cv::Mat &mask, std::vector<double> &thetav, int sx, int ex, int sy, int ey, int noflag){
+		return radonSearch(img, mask, thetav, sx, ex, sy, ey, noflag, NULL);
+	}
 
-		res.push_back(ind2 - maxv);
-		return res;
+	std::vector<double> findRadonTransformAngle(const cv::Mat &img, cv::Mat &mask, std::vector<double> &thetav, int sx, int ex, int sy, int ey, int noflag, cv::Mat &projection){
+		return radonSearch(img, mask, thetav, sx, ex, sy, ey, noflag, &projection);
 	}
 
 	//Marks approximate vertical cradle position in the mask as vertical cradle so that it won't interfere when estimating horizontal cradle piece position
@@ -2302,50 +2911,189 @@ namespace CradleFunctions{
 		}
 	}
 
-	//Cradle detection method, returning approximate horizontal/vertical cradle positions in 'vrange' and 'hrange'
+	//Cradle detection method, returning approximate horizontal/vertical cradle positions in 'vrange' and 'hrange'
+	void projectionProfiles(const cv::Mat &in, const cv::Mat &mask, int L, cv::Mat &vsum, cv::Mat &hsum){
+		DetectionStream ds = createDetectionStream(in.cols, L);
+		addStrip(ds, in, mask);
+		finishProfiles(ds, vsum, hsum);
+	}
+
+	DetectionStream createDetectionStream(int cols, int L){
+		DetectionStream ds;
+		ds.L = L;
+		ds.cols = cols;
+		ds.rows = 0;
+		ds.next = 0;
+		ds.vsum = cv::Mat(1, cols, CV_32F, cv::Scalar(0));
+		ds.hsum.clear();
+		ds.prefix = std::vector<double>(cols + 2 * L + 1);
+		ds.up = std::vector<double>(cols, 0);
+		ds.down = std::vector<double>(cols, 0);
+		ds.ring = cv::Mat(2 * L + 1, cols, CV_32F);
+		ds.mring = cv::Mat(2 * L + 1, cols, CV_8U);
+		return ds;
+	}
+
+	//Projection of the vertical gradient for row ds.next (rows [next-L, next+L-1] are in the ring buffer and window sums)
+	static void projectNextRow(DetectionStream &ds){
+		int K = ds.ring.rows;
+		const char *mrow = ds.mring.ptr<char>(ds.next % K);
+
+		double hrow = 0;
+		for (int j = 0; j < ds.cols; j++){
+			float valid = ((mrow[j] & DEFECT) != DEFECT) ? 1.0f : 0.0f;
+			hrow += valid * (float)(ds.up[j] - ds.down[j]);
+		}
+		ds.hsum.push_back((float)hrow);
+	}
+
+	void addStrip(DetectionStream &ds, const cv::Mat &strip, const cv::Mat &mask_strip){
+		int L = ds.L, M = ds.cols, K = ds.ring.rows;
+		float *vs = ds.vsum.ptr<float>(0);
+
+		//The gradients are box differences of width 2L (replicated borders), computed from running sums
+		//as the rows arrive, without creating the gradient images
+		for (int r = 0; r < strip.rows; r++){
+			int i = ds.rows;
+			const float *row = strip.ptr<float>(r);
+			const char *mrow = mask_strip.ptr<char>(r);
+
+			//Keep the row until the windows have moved past it
+			memcpy(ds.ring.ptr<float>(i % K), row, M * sizeof(float));
+			memcpy(ds.mring.ptr<char>(i % K), mrow, M * sizeof(char));
+			ds.rows++;
+
+			//Horizontal gradient: sum of the L pixels on the left minus sum of the L pixels on the right (starting at j)
+			std::vector<double> &prefix = ds.prefix;
+			prefix[0] = 0;
+			for (int j = 0; j < M + 2 * L; j++){
+				prefix[j + 1] = prefix[j] + row[std::min(std::max(j - L, 0), M - 1)];
+			}
+			for (int j = 0; j < M; j++){
+				float valid = ((mrow[j] & DEFECT) != DEFECT) ? 1.0f : 0.0f;
+				double gh = (prefix[j + L] - prefix[j]) - (prefix[j + 2 * L] - prefix[j + L]);
+				vs[j] += valid * (float)gh;
+			}
+
+			//Vertical gradient: rows above the top of the image replicate the first row
+			if (i == 0){
+				for (int j = 0; j < M; j++){
+					ds.up[j] = L * (double)row[j];
+				}
+			}
+			if (i < ds.next + L){
+				for (int j = 0; j < M; j++){
+					ds.down[j] += row[j];
+				}
+			}
+
+			//Row ds.next is complete when the L rows starting at it have arrived
+			if (ds.rows >= ds.next + L){
+				projectNextRow(ds);
+
+				//Slide column windows one row down
+				const float *rcur = ds.ring.ptr<float>(ds.next % K);
+				const float *rout = ds.ring.ptr<float>(std::max(ds.next - L, 0) % K);
+				for (int j = 0; j < M; j++){
+					ds.up[j] += rcur[j] - rout[j];
+					ds.down[j] -= rcur[j];
+				}
+				ds.next++;
+			}
+		}
+	}
+
+	void finishProfiles(DetectionStream &ds, cv::Mat &vsum, cv::Mat &hsum){
+		int L = ds.L, M = ds.cols, K = ds.ring.rows, N = ds.rows;
+
+		if (N > 0){
+			//Rows below the bottom of the image replicate the last row
+			const float *rlast = ds.ring.ptr<float>((N - 1) % K);
+			for (int j = 0; j < M; j++){
+				ds.down[j] += (ds.next + L - N) * (double)rlast[j];
+			}
+
+			while (ds.next < N){
+				projectNextRow(ds);
+
+				//Slide column windows one row down
+				const float *rcur = ds.ring.ptr<float>(ds.next % K);
+				const float *rout = ds.ring.ptr<float>(std::max(ds.next - L, 0) % K);
+				for (int j = 0; j < M; j++){
+					ds.up[j] += rcur[j] - rout[j];
+					ds.down[j] += rlast[j] - rcur[j];
+				}
+				ds.next++;
+			}
+		}
+
+		vsum = ds.vsum;
+		hsum = cv::Mat(1, N, CV_32F);
+		for (int i = 0; i < N; i++){
+			hsum.at<float>(0, i) = ds.hsum[i];
+		}
+	}
+
+	void finishDetection(DetectionStream &ds, std::vector<int> &vrange, std::vector<int> &hrange){
+		cv::Mat vsum, hsum;
+		finishProfiles(ds, vsum, hsum);
+		detectFromProfiles(vsum, hsum, vrange, hrange);
+	}
+
+	void finishDetection(DetectionStream &ds, int vn, int hn, std::vector<int> &vrange, std::vector<int> &hrange){
+		cv::Mat vsum, hsum;
+		finishProfiles(ds, vsum, hsum);
+		detectFromProfiles(vsum, hsum, vn, hn, vrange, hrange);
+	}
+
 	void cradledetect(const cv::Mat &in, const cv::Mat &mask, std::vector<int> &vrange, std::vector<int> &hrange){
 
-		//Filter gradients for horizontal/vertical
+		//Projections of the horizontal/vertical gradients
 		int L = 20;
-		//Vertical filtering
-		cv::Mat vkern(1, 2 * L, CV_32F, 1);				//{-1, -1, -1, .. 1, 1, 1, 1}
-		for (int i = L; i < 2 * L; i++){
-			vkern.at<float>(0, i) = -1;
+		cv::Mat vsum, hsum;
+		projectionProfiles(in, mask, L, vsum, hsum);
+
+		//Find cradle pieces
+		detectFromProfiles(vsum, hsum, vrange, hrange);
+	}
+
+	//Sort peak positions in increasing order, together with their type and value
+	static void sortPeaksByPosition(std::vector<int> &peaks, std::vector<int> &peak_type, std::vector<double> &peak_val){
+		std::vector<int> order(peaks.size());
+		for (int i = 0; i < order.size(); i++){
+			order[i] = i;
 		}
-		cv::Mat hkern(2 * L, 1, CV_32F, 1);				//{-1, -1, -1, .. 1, 1, 1, 1}'
-		for (int i = L; i < 2 * L; i++){
-			hkern.at<float>(i, 0) = -1;
+		std::sort(order.begin(), order.end(), [&peaks](int a, int b){ return peaks[a] < peaks[b]; });
+
+		std::vector<int> p(peaks.size()), t(peaks.size());
+		std::vector<double> v(peaks.size());
+		for (int i = 0; i < order.size(); i++){
+			p[i] = peaks[order[i]];
+			t[i] = peak_type[order[i]];
+			v[i] = peak_val[order[i]];
 		}
+		peaks.swap(p);
+		peak_type.swap(t);
+		peak_val.swap(v);
+	}
 
-		cv::Mat ghimg, gvimg;
-		cv::filter2D(in, gvimg, CV_32F, hkern, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
-		cv::filter2D(in, ghimg, CV_32F, vkern, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
+	void detectFromProfiles(const cv::Mat &vsum, const cv::Mat &hsum, std::vector<int> &vrange, std::vector<int> &hrange){
 
 		std::vector<int> solv;
 		std::vector<int> solh;
 		cv::Mat dest;
 		
-		//Sum up vertical elements
-		cv::Mat vsum(1, ghimg.cols, CV_32F, cv::Scalar(0));
-		for (int j = 0; j < ghimg.cols; j++){
-			for (int i = 0; i < ghimg.rows; i++){
-				if ((mask.at<char>(i, j) & DEFECT) != DEFECT){
-					vsum.at<float>(0, j) = vsum.at<float>(0, j) + ghimg.at<float>(i, j);
-				}
-			}
-		}
-
 		//Smooth filtering
-		int s = std::max(3.0, std::min(10.0, std::max(gvimg.rows, gvimg.cols) / 230.0));	// 3 <= s <= 10
+		int s = std::max(3.0, std::min(10.0, std::max(hsum.cols, vsum.cols) / 230.0));	// 3 <= s <= 10
 		cv::Mat smooth(1, s, CV_32F, 1.0 / s);
 		cv::filter2D(vsum, dest, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
 
 		//Normalize - extract mean of the signal
 		float mean = 0;
-		for (int i = 0; i < (ghimg).cols; i++){
+		for (int i = 0; i < vsum.cols; i++){
 			mean += dest.at<float>(0, i);
 		}
-		mean /= (ghimg).cols;
+		mean /= vsum.cols;
 		dest = dest - mean;
 
 		std::vector<int> peaks, peak_type, allpeaksi;
@@ -2410,21 +3158,7 @@ namespace CradleFunctions{
 		}
 
 		//Sort maximas based on position
-		for (int i = 0; i < peaks.size(); i++){
-			for (int j = i + 1; j < peaks.size(); j++){
-				if (peaks[i] > peaks[j]){
-					int tmp = peaks[i];
-					peaks[i] = peaks[j];
-					peaks[j] = tmp;
-					tmp = peak_type[i];
-					peak_type[i] = peak_type[j];
-					peak_type[j] = tmp;
-					float tmp2 = peak_val[i];
-					peak_val[i] = peak_val[j];
-					peak_val[j] = tmp2;
-				}
-			}
-		}
+		sortPeaksByPosition(peaks, peak_type, peak_val);
 
 		//Create array of start/end positions
 		int state;
@@ -2447,17 +3181,7 @@ namespace CradleFunctions{
 		}
 		if (state == MAXIMA){
 			//Image ends with a low point, mark last segment as cradle
-			vrange.push_back(gvimg.cols);
-		}
-
-		//Sum up vertical elements
-		cv::Mat hsum(1, (gvimg).rows, CV_32F, cv::Scalar(0));
-		for (int j = 0; j < (gvimg).cols; j++){
-			for (int i = 0; i < (gvimg).rows; i++){
-				if ((mask.at<char>(i, j) & DEFECT) != DEFECT){
-					hsum.at<float>(0, i) = hsum.at<float>(0, i) + (gvimg).at<float>(i, j);
-				}
-			}
+			vrange.push_back(vsum.cols);
 		}
 
 		//Smooth filtering
@@ -2465,10 +3189,10 @@ namespace CradleFunctions{
 		
 		//Normalize - extract mean of the signal
 		mean = 0;
-		for (int i = 0; i < (gvimg).rows; i++){
+		for (int i = 0; i < hsum.cols; i++){
 			mean += dest.at<float>(0, i);
 		}
-		mean /= (gvimg).rows;
+		mean /= hsum.cols;
 		//Extract mean
 		dest = dest - mean;
 
@@ -2536,21 +3260,7 @@ namespace CradleFunctions{
 		}
 
 		//Sort maximas based on position
-		for (int i = 0; i < peaks.size(); i++){
-			for (int j = i + 1; j < peaks.size(); j++){
-				if (peaks[i] > peaks[j]){
-					int tmp = peaks[i];
-					peaks[i] = peaks[j];
-					peaks[j] = tmp;
-					tmp = peak_type[i];
-					peak_type[i] = peak_type[j];
-					peak_type[j] = tmp;
-					float tmp2 = peak_val[i];
-					peak_val[i] = peak_val[j];
-					peak_val[j] = tmp2;
-				}
-			}
-		}
+		sortPeaksByPosition(peaks, peak_type, peak_val);
 
 		//Create array of start/end positions
 		if (peak_type[0] == MAXIMA){
@@ -2572,7 +3282,7 @@ namespace CradleFunctions{
 		}
 		if (state == MAXIMA){
 			//Image ends with a low point, mark last segment as cradle
-			hrange.push_back(gvimg.rows);
+			hrange.push_back(hsum.cols);
 		}
 	}
 
@@ -2580,374 +3290,185 @@ namespace CradleFunctions{
 	//with number of vertical and horizontal pieces to be detected specified by 'vn' and 'hn' 
 	void cradledetect(const cv::Mat &in, const cv::Mat &mask, int vn, int hn, std::vector<int> &vrange, std::vector<int> &hrange){
 
-		//Filter gradients for horizontal/vertical
+		//Projections of the horizontal/vertical gradients
 		int L = 20;
-		//Vertical filtering
-		cv::Mat vkern(1, 2 * L, CV_32F, 1);				//{-1, -1, -1, .. 1, 1, 1, 1}
-		for (int i = L; i < 2 * L; i++){
-			vkern.at<float>(0, i) = -1;
-		}
-		cv::Mat hkern(2 * L, 1, CV_32F, 1);				//{-1, -1, -1, .. 1, 1, 1, 1}'
-		for (int i = L; i < 2 * L; i++){
-			hkern.at<float>(i, 0) = -1;
-		}
+		cv::Mat vsum, hsum;
+		projectionProfiles(in, mask, L, vsum, hsum);
 
-		cv::Mat ghimg, gvimg;
-		cv::filter2D(in, gvimg, CV_32F, hkern, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
-		cv::filter2D(in, ghimg, CV_32F, vkern, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
+		//Find cradle pieces
+		detectFromProfiles(vsum, hsum, vn, hn, vrange, hrange);
+	}
 
-		std::vector<int> solv;
-		std::vector<int> solh;
-		cv::Mat dest;
+	//Peak of a detection profile
+	struct ProfilePeak{
+		int pos;		//Position in the profile
+		int type;		//MAXIMA or MINIMA
+		float val;		//Profile value
+	};
+
+	//Guided selection of 'n' cradle ranges from the smoothed, zero-mean detection profile 'dest'
+	//The strongest maxima/minima are added one pair per step, until 'n' ranges can be formed or no peaks are left.
+	//Ranges alternate between the first peaks of runs of equal type (by position), so a step only updates the number
+	//of such runs around the inserted peaks (O(log P)); the ranges and their costs are built once, at the last step
+	static void selectRanges(const cv::Mat &dest, int n, std::vector<int> &range){
+		const float *d = dest.ptr<float>(0);
+		int len = dest.cols;
+
+		//Maxima in a max-heap, minima in a min-heap (by value)
+		std::priority_queue<std::pair<float, int>> maxq;
+		std::priority_queue<std::pair<float, int>, std::vector<std::pair<float, int>>, std::greater<std::pair<float, int>>> minq;
+		for (int i = 1; i < len - 1; i++){
+			if (d[i - 1] < d[i] && d[i + 1] < d[i])
+				maxq.push(std::make_pair(d[i], i));
+			if (d[i - 1] > d[i] && d[i + 1] > d[i])
+				minq.push(std::make_pair(d[i], i));
+		}
 
-		//Sum up vertical elements
-		cv::Mat vsum(1, ghimg.cols, CV_32F, cv::Scalar(0));
-		for (int j = 0; j < ghimg.cols; j++){
-			for (int i = 0; i < ghimg.rows; i++){
-				if ((mask.at<char>(i, j) & DEFECT) != DEFECT){
-					vsum.at<float>(0, j) = vsum.at<float>(0, j) + ghimg.at<float>(i, j);
-				}
+		std::map<int, ProfilePeak> peaks;	//Selected peaks by position
+		int runs = 0;						//Number of runs of equal type among the selected peaks
+
+		//Insert a peak, updating the runs it splits, extends or joins
+		auto insertPeak = [&peaks, &runs](int pos, int type, float val){
+			ProfilePeak pk = { pos, type, val };
+			std::map<int, ProfilePeak>::iterator it = peaks.insert(std::make_pair(pos, pk)).first;
+			std::map<int, ProfilePeak>::iterator next = it;
+			++next;
+			int a = (it != peaks.begin()) ? std::prev(it)->second.type : -1;
+			int b = (next != peaks.end()) ? next->second.type : -1;
+			if (a == -1 && b == -1)
+				runs = 1;
+			else if (a == -1)
+				runs += (type != b);
+			else if (b == -1)
+				runs += (type != a);
+			else
+				runs += (a != type) + (type != b) - (a != b);
+		};
+
+		int sel = 0;
+		bool added = true;
+		while (added){
+			//Take the next strongest maximum/minimum
+			added = false;
+			if (!maxq.empty()){
+				insertPeak(maxq.top().second, MAXIMA, maxq.top().first);
+				maxq.pop();
+				added = true;
+			}
+			if (!minq.empty()){
+				insertPeak(minq.top().second, MINIMA, minq.top().first);
+				minq.pop();
+				added = true;
+			}
+			sel++;
+
+			//Start with the n strongest peaks of each type
+			if (sel < n && added)
+				continue;
+
+			//Ranges start at the image border before a leading maximum and end at it after a trailing minimum
+			if (!peaks.empty()){
+				int bounds = runs + (peaks.begin()->second.type == MAXIMA) + (peaks.rbegin()->second.type == MINIMA);
+				if (bounds / 2 >= n)
+					break;
 			}
 		}
 
-		//Smooth filtering
-		int s = std::max(3.0, std::min(10.0, std::max(gvimg.rows, gvimg.cols) / 230.0));	// 3 <= s <= 10
-		cv::Mat smooth(1, s, CV_32F, 1.0 / s);
-		cv::filter2D(vsum, dest, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
+		range.clear();
+		if (peaks.empty())
+			return;
 
-		//Normalize - extract mean of the signal
-		float mean = 0;
-		for (int i = 0; i < (ghimg).cols; i++){
-			mean += dest.at<float>(0, i);
+		//Create array of start/end positions
+		std::vector<double> cost;			//Cost of each range candidate
+		int state;
+		if (peaks.begin()->second.type == MAXIMA){
+			//Image starts with cradle part
+			range.push_back(0);
+			cost.push_back(std::abs(peaks.begin()->second.val) * 2);
+			state = MAXIMA;
 		}
-		mean /= (ghimg).cols;
-		dest = dest - mean;
-
-		std::vector<int> peaks, peak_type, allpeaksi;
-		std::vector<double> peak_val, allpeaks, cost;
-		int state, detected, selvn = vn;
-
-		detected = 0;
-		while (vn != detected){
-
-			vrange.clear();
-
-			//Get maximas
-			for (int i = 1; i < dest.cols - 1; i++){
-				if (dest.at<float>(0, i - 1) < dest.at<float>(0, i) &&
-					dest.at<float>(0, i + 1) < dest.at<float>(0, i)){
-					allpeaksi.push_back(i);
-					allpeaks.push_back(dest.at<float>(0, i));
-				}
-			}
-
-			//Sort by intensity
-			for (int i = 0; i < allpeaks.size(); i++){
-				for (int j = i + 1; j < allpeaks.size(); j++){
-					if (allpeaks[i] < allpeaks[j]){
-						int tmp = allpeaksi[i];
-						allpeaksi[i] = allpeaksi[j];
-						allpeaksi[j] = tmp;
-						float tmp2 = allpeaks[i];
-						allpeaks[i] = allpeaks[j];
-						allpeaks[j] = tmp2;
-					}
-				}
-			}
-
-			//Take vn max peaks
-			for (int i = 0; i < std::min(selvn, (int)allpeaks.size()); i++){
-				//Add to accepted list
-				peaks.push_back(allpeaksi[i]);
-				peak_val.push_back(allpeaks[i]);
-				peak_type.push_back(MAXIMA);
-			}
-
-			//Clear arrays
-			allpeaks.clear();
-			allpeaksi.clear();
-
-			//Get minimas
-			for (int i = 1; i < dest.cols - 1; i++){
-				if (dest.at<float>(0, i - 1) > dest.at<float>(0, i) &&
-					dest.at<float>(0, i + 1) > dest.at<float>(0, i)){
-					allpeaksi.push_back(i);
-					allpeaks.push_back(dest.at<float>(0, i));
-				}
-			}
-
-			//Sort by intensity
-			for (int i = 0; i < allpeaks.size(); i++){
-				for (int j = i + 1; j < allpeaks.size(); j++){
-					if (allpeaks[i] > allpeaks[j]){
-						int tmp = allpeaksi[i];
-						allpeaksi[i] = allpeaksi[j];
-						allpeaksi[j] = tmp;
-						float tmp2 = allpeaks[i];
-						allpeaks[i] = allpeaks[j];
-						allpeaks[j] = tmp2;
-					}
+		else{
+			state = MINIMA;
+		}
+		for (std::map<int, ProfilePeak>::iterator it = peaks.begin(); it != peaks.end(); ++it){
+			const ProfilePeak &pk = it->second;
+			if (state == pk.type){
+				range.push_back(pk.pos);
+				if (state == MINIMA){
+					cost.push_back(std::abs(pk.val));
 				}
-			}
-
-			//Take vn max peaks
-			for (int i = 0; i < std::min(selvn, (int)allpeaks.size()); i++){
-				//Add to accepted list
-				peaks.push_back(allpeaksi[i]);
-				peak_val.push_back(allpeaks[i]);
-				peak_type.push_back(MINIMA);
-			}
-
-			//Sort peaks based on position
-			for (int i = 0; i < peaks.size(); i++){
-				for (int j = i + 1; j < peaks.size(); j++){
-					if (peaks[i] > peaks[j]){
-						int tmp = peaks[i];
-						peaks[i] = peaks[j];
-						peaks[j] = tmp;
-						tmp = peak_type[i];
-						peak_type[i] = peak_type[j];
-						peak_type[j] = tmp;
-						float tmp2 = peak_val[i];
-						peak_val[i] = peak_val[j];
-						peak_val[j] = tmp2;
-					}
+				else{
+					cost[cost.size() - 1] += std::abs(pk.val);
 				}
-			}
-
-			//Create array of start/end positions
-			if (peak_type[0] == MAXIMA){
-				//Image starts with cradle part
-				vrange.push_back(0);
-				cost.push_back(std::abs(peak_val[0]) * 2);
-				state = MAXIMA;
-			}
-			else{
-				state = MINIMA;
-			}
-			for (int i = 0; i < peak_type.size(); i++){
-				if (state == peak_type[i]){
-					vrange.push_back(peaks[i]);
-					if (state == MINIMA){
-						cost.push_back(std::abs(peak_val[i]));
-					}
-					else{
-						cost[cost.size() - 1] += std::abs(peak_val[i]);
-					}
 
-					if (state == MAXIMA)
-						state = MINIMA;
-					else if (state == MINIMA)
-						state = MAXIMA;
-				}
-			}
-			if (state == MAXIMA){
-				//Image ends with a low point, mark last segment as cradle
-				vrange.push_back(gvimg.cols);
-				cost[cost.size() - 1] *= 2;
+				if (state == MAXIMA)
+					state = MINIMA;
+				else if (state == MINIMA)
+					state = MAXIMA;
 			}
+		}
+		if (state == MAXIMA){
+			//Image ends with a low point, mark last segment as cradle
+			range.push_back(len);
+			cost[cost.size() - 1] *= 2;
+		}
 
-			//Reduce size to vn elements
-			while (vrange.size() > 2 * vn){
-				int mini = 0;
-				float minc = cost[0];
-				for (int i = 0; i < cost.size(); i++){
-					if (cost[i] < minc){
-						minc = cost[i];
-						mini = i;
-					}
-				}
-				//Shift over previous points
-				for (int i = mini * 2 + 2; i < vrange.size(); i++){
-					vrange[i - 2] = vrange[i];
-				}
-				//Resize
-				vrange.resize(vrange.size() - 2);
-			}
-			detected = vrange.size() / 2;
-			if (detected < vn){
-				selvn++;
-			}
+		//Reduce size to n elements: keep the n ranges of highest cost
+		//(equal costs: the earlier range is dropped first), in order of position
+		int pairs = range.size() / 2;
+		if (pairs > n){
+			std::vector<int> order(pairs);
+			for (int i = 0; i < pairs; i++){
+				order[i] = i;
+			}
+			std::nth_element(order.begin(), order.begin() + n, order.end(), [&cost](int a, int b){
+				return cost[a] > cost[b] || (cost[a] == cost[b] && a > b);
+			});
+			order.resize(n);
+			std::sort(order.begin(), order.end());
+
+			std::vector<int> kept(2 * n);
+			for (int i = 0; i < n; i++){
+				kept[2 * i] = range[2 * order[i]];
+				kept[2 * i + 1] = range[2 * order[i] + 1];
+			}
+			range.swap(kept);
 		}
+	}
 
+	void detectFromProfiles(const cv::Mat &vsum, const cv::Mat &hsum, int vn, int hn, std::vector<int> &vrange, std::vector<int> &hrange){
+		cv::Mat dest;
 
-		//Sum up vertical elements
-		cv::Mat hsum(1, (gvimg).rows, CV_32F, cv::Scalar(0));
-		for (int j = 0; j < (gvimg).cols; j++){
-			for (int i = 0; i < (gvimg).rows; i++){
-				if ((mask.at<char>(i, j) & DEFECT) != DEFECT){
-					hsum.at<float>(0, i) = hsum.at<float>(0, i) + (gvimg).at<float>(i, j);
-				}
-			}
+		//Smooth filtering
+		int s = std::max(3.0, std::min(10.0, std::max(hsum.cols, vsum.cols) / 230.0));	// 3 <= s <= 10
+		cv::Mat smooth(1, s, CV_32F, 1.0 / s);
+		cv::filter2D(vsum, dest, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
+
+		//Normalize - extract mean of the signal
+		float mean = 0;
+		for (int i = 0; i < vsum.cols; i++){
+			mean += dest.at<float>(0, i);
 		}
+		mean /= vsum.cols;
+		dest = dest - mean;
 
+		//Find vn vertical pieces
+		selectRanges(dest, vn, vrange);
 
 		//Smooth filtering
 		cv::filter2D(hsum, dest, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
 
 		//Normalize - extract mean of the signal
 		mean = 0;
-		for (int i = 0; i < (gvimg).rows; i++){
+		for (int i = 0; i < hsum.cols; i++){
 			mean += dest.at<float>(0, i);
 		}
-		mean /= (gvimg).rows;
+		mean /= hsum.cols;
 		//Extract mean
 		dest = dest - mean;
 
-		peaks.clear();
-		peak_val.clear();
-		peak_type.clear();
-		allpeaksi.clear();
-		allpeaks.clear();
-		cost.clear();
-
-		int selhn = hn;
-		detected = 0;
-		while (hn != detected){
-
-			hrange.clear();
-
-			//Get maximas
-			for (int i = 1; i < dest.cols - 1; i++){
-				if (dest.at<float>(0, i - 1) < dest.at<float>(0, i) &&
-					dest.at<float>(0, i + 1) < dest.at<float>(0, i)){
-					allpeaksi.push_back(i);
-					allpeaks.push_back(dest.at<float>(0, i));
-				}
-			}
-
-			//Sort by intensity
-			for (int i = 0; i < allpeaks.size(); i++){
-				for (int j = i + 1; j < allpeaks.size(); j++){
-					if (allpeaks[i] < allpeaks[j]){
-						int tmp = allpeaksi[i];
-						allpeaksi[i] = allpeaksi[j];
-						allpeaksi[j] = tmp;
-						float tmp2 = allpeaks[i];
-						allpeaks[i] = allpeaks[j];
-						allpeaks[j] = tmp2;
-					}
-				}
-			}
-
-			//Take hn max peaks
-			for (int i = 0; i < std::min(selhn, (int)allpeaks.size()); i++){
-				//Add to accepted list
-				peaks.push_back(allpeaksi[i]);
-				peak_val.push_back(allpeaks[i]);
-				peak_type.push_back(MAXIMA);
-			}
-
-			//Clear arrays
-			allpeaks.clear();
-			allpeaksi.clear();
-
-			//Get minimas
-			for (int i = 1; i < dest.cols - 1; i++){
-				if (dest.at<float>(0, i - 1) > dest.at<float>(0, i) &&
-					dest.at<float>(0, i + 1) > dest.at<float>(0, i)){
-					allpeaksi.push_back(i);
-					allpeaks.push_back(dest.at<float>(0, i));
-				}
-			}
-
-			//Sort by intensity
-			for (int i = 0; i < allpeaks.size(); i++){
-				for (int j = i + 1; j < allpeaks.size(); j++){
-					if (allpeaks[i] > allpeaks[j]){
-						int tmp = allpeaksi[i];
-						allpeaksi[i] = allpeaksi[j];
-						allpeaksi[j] = tmp;
-						float tmp2 = allpeaks[i];
-						allpeaks[i] = allpeaks[j];
-						allpeaks[j] = tmp2;
-					}
-				}
-			}
-
-			//Take hn max peaks
-			for (int i = 0; i < std::min(selhn, (int)allpeaks.size()); i++){
-				//Add to accepted list
-				peaks.push_back(allpeaksi[i]);
-				peak_val.push_back(allpeaks[i]);
-				peak_type.push_back(MINIMA);
-			}
-
-			//Sort peaks based on position
-			for (int i = 0; i < peaks.size(); i++){
-				for (int j = i + 1; j < peaks.size(); j++){
-					if (peaks[i] > peaks[j]){
-						int tmp = peaks[i];
-						peaks[i] = peaks[j];
-						peaks[j] = tmp;
-						tmp = peak_type[i];
-						peak_type[i] = peak_type[j];
-						peak_type[j] = tmp;
-						float tmp2 = peak_val[i];
-						peak_val[i] = peak_val[j];
-						peak_val[j] = tmp2;
-					}
-				}
-			}
-
-			//Create array of start/end positions
-			if (peak_type[0] == MAXIMA){
-				//Image starts with cradle part
-				hrange.push_back(0);
-				cost.push_back(std::abs(peak_val[0]) * 2);
-				state = MAXIMA;
-			}
-			else{
-				state = MINIMA;
-			}
-			for (int i = 0; i < peak_type.size(); i++){
-				if (state == peak_type[i]){
-					hrange.push_back(peaks[i]);
-					if (state == MINIMA){
-						cost.push_back(std::abs(peak_val[i]));
-					}
-					else{
-						cost[cost.size() - 1] += std::abs(peak_val[i]);
-					}
-
-					if (state == MAXIMA)
-						state = MINIMA;
-					else if (state == MINIMA)
-						state = MAXIMA;
-				}
-			}
-			if (state == MAXIMA){
-				//Image ends with a low point, mark last segment as cradle
-				hrange.push_back(gvimg.rows);
-				cost[cost.size() - 1] *= 2;
-			}
-
-			//Reduce size to hn elements
-			while (hrange.size() > 2 * hn){
-				int mini = 0;
-				float minc = cost[0];
-				for (int i = 0; i < cost.size(); i++){
-					if (cost[i] < minc){
-						minc = cost[i];
-						mini = i;
-					}
-				}
-				//Shift over previous points
-				for (int i = mini * 2 + 2; i < hrange.size(); i++){
-					hrange[i - 2] = hrange[i];
-				}
-				//Resize
-				hrange.resize(hrange.size() - 2);
-			}
-
-
-			detected = hrange.size() / 2;
-			if (detected < hn){
-				selhn++;
-			}
-		}
-
-		return;
+		//Find hn horizontal pieces
+		selectRanges(dest, hn, hrange);
 	}
 
 	//Functon used for profiling edge-shape of cradle pieces based on the Radon transform.
@@ -3083,30 +3604,123 @@ namespace CradleFunctions{
 		return res;
 	}
 
+	//Strip covered by a projection bin, as computed by pointBackProjection(): columns [l, r], with the
+	//upper/lower edge rows evaluated on the fly instead of being stored
+	struct BinStrip{
+		int l, r;				//Column range (empty if l > r)
+		bool flat;				//90 degree case: constant rows
+		int up, down;			//Rows of the flat case
+		double base;			//L / 2 - b / sin(theta)
+		double slope;			//cotan(theta)
+		int M;					//Middle column
+	};
+
+	static BinStrip binStrip(int b, double angle, int s0, int s1){
+		BinStrip st;
+		int L = s0 + 1;
+		int M = (s1 + 1) / 2;
+		double theta = angle*M_PI / 180;
+		st.M = M;
+		st.flat = std::abs(angle - 90) < 0.1;
+		if (st.flat){
+			st.l = 0;
+			st.r = s1 - 1;
+			st.up = std::ceil(L / 2 - b);
+			st.down = std::floor(L / 2 - b);
+			return st;
+		}
+
+		if (angle < 90){
+			st.l = std::max((int)std::ceil(tan(theta)*(.5 + 1 / 2 / sin(theta) + b / sin(theta) - L / 2) + M), 0);
+			st.r = std::min((int)std::floor(tan(theta)*(L / 2 - 1 / 2 / sin(theta) + b / sin(theta)) + M), s1 - 1);
+		}
+		else{
+			st.r = std::min((int)std::floor(tan(theta)*(.5 + 1 / 2 / sin(theta) + b / sin(theta) - L / 2) + M), s1 - 1);
+			st.l = std::max((int)std::ceil(tan(theta)*(L / 2 - 1 / 2 / sin(theta) + b / sin(theta)) + M), 0);
+		}
+		if (st.l > M || st.r < M){
+			st.l = 1;
+			st.r = 0;
+		}
+		st.base = L / 2 - b / std::sin(theta);
+		st.slope = cotan(theta);
+		return st;
+	}
+
+	//Upper/lower edge row of a bin strip at column k
+	static inline int stripUp(const BinStrip &st, int k){
+		return st.flat ? st.up : (int)std::ceil(st.base + (k - st.M)*st.slope) - 1;
+	}
+	static inline int stripDown(const BinStrip &st, int k){
+		return st.flat ? st.down : (int)std::floor(st.base + (k - st.M)*st.slope);
+	}
+
+	//Back projects the bins -maxbin..maxbin-1 with a positive weight: both edge pixels of each column of the bin strip
+	//are marked with 'flag' in the mask, and if 'cradle' is given, weight / (r - l) / 2 is added to them
+	//The rows are split into bands processed in parallel; every band visits the bins in order, so the sums do not
+	//depend on the number of threads
+	static void rasterizeBins(const std::vector<float> &weight, int maxbin, double angle, int s0, int s1, int shift, int flag, cv::Mat &mask, cv::Mat *cradle){
+		std::vector<BinStrip> strips(weight.size());
+		for (int i = 0; i < weight.size(); i++){
+			if (weight[i] > 0){
+				strips[i] = binStrip(i - maxbin, angle, s0, s1);
+			}
+		}
+
+		int offset = shift - s0 / 2;
+		const int band = 64;
+		int nbands = (mask.rows + band - 1) / band;
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int bnd = 0; bnd < nbands; bnd++){
+			int y0 = bnd * band, y1 = std::min(mask.rows, y0 + band);
+			for (int i = 0; i < weight.size(); i++){
+				const BinStrip &st = strips[i];
+				//Same test as when the strips were built, so NaN weights are skipped too
+				if (!(weight[i] > 0) || st.l > st.r){
+					continue;
+				}
+
+				//Rows are monotonic along the strip, skip bins that do not reach this band
+				int lo = std::min(stripUp(st, st.l), stripUp(st, st.r)) + offset;
+				int hi = std::max(stripDown(st, st.l), stripDown(st, st.r)) + offset;
+				if (hi < y0 || lo >= y1){
+					continue;
+				}
+
+				double delta = weight[i] / (st.r - st.l) / 2;
+				for (int k = st.l; k <= st.r; k++){
+					int yu = stripUp(st, k) + offset;
+					int yd = stripDown(st, k) + offset;
+					if (yu >= y0 && yu < y1){
+						mask.ptr<char>(yu)[k] |= flag;
+						if (cradle != NULL){
+							cradle->ptr<float>(yu)[k] += delta;
+						}
+					}
+					if (yd >= y0 && yd < y1){
+						mask.ptr<char>(yd)[k] |= flag;
+						if (cradle != NULL){
+							cradle->ptr<float>(yd)[k] += delta;
+						}
+					}
+				}
+			}
+		}
+	}
+
 	//Functon used for profiling edge-shape of cradle pieces based on the Radon transform.
 	//For more details and comments, look into the Matlab code, function getEdges()
 	void backProjection(cv::Mat &m, cv::Mat &cradle, cv::Mat &mask, double angle, int s0, int s1, int shift, int flag, int noflag){
 		double theta = angle * M_PI / 180;
 		int maxbin = std::floor((s0 - 1) / 2 / sin(theta));
-		cv::Mat res(s0, s1, CV_32F, cv::Scalar(0));
 
+		std::vector<float> weight(std::max(0, 2 * maxbin));
 		int j = (int)(-maxbin + (m).rows / 2);
-		for (int i = -maxbin; i <= maxbin - 1; i++){
-			if ((m).at<float>(j, 0) > 0){
-				cv::Mat up, down;
-				std::vector<int> v = pointBackProjection(i, angle, s0, s1, up, down);
-				int l = v[0];
-				int r = v[1];
-				double delta = (m).at<float>(j, 0) / (r - l) / 2;
-				for (int k = l; k <= r; k++){
-					mask.at<char>(shift + up.at<int>(k - l, 0) - s0 / 2, k) |= flag;
-					mask.at<char>(shift + down.at<int>(k - l, 0) - s0 / 2, k) |= flag;
-					(cradle).at<float>(shift + up.at<int>(k - l, 0) - s0 / 2, k) += delta;
-					(cradle).at<float>(shift + down.at<int>(k - l, 0) - s0 / 2, k) += delta;
-				}
-			}
-			j++;
+		for (int i = 0; i < 2 * maxbin; i++){
+			weight[i] = (m).at<float>(j + i, 0);
 		}
+		rasterizeBins(weight, maxbin, angle, s0, s1, shift, flag, mask, &cradle);
 	}
 
 	//Functon used for profiling edge-shape of cradle pieces based on the Radon transform.
@@ -3114,22 +3728,13 @@ namespace CradleFunctions{
 	void backProjectionMask(std::vector<float> &m, cv::Mat &mask, double angle, int s0, int s1, int shift, int flag, int noflag){
 		double theta = angle * M_PI / 180;
 		int maxbin = std::floor((s0 - 1) / 2 / sin(theta));
-		cv::Mat res(s0, s1, CV_32F, cv::Scalar(0));
 
+		std::vector<float> weight(std::max(0, 2 * maxbin));
 		int j = (int)(-maxbin + (m).size() / 2) + 1;
-		for (int i = -maxbin; i <= maxbin - 1; i++){
-			if (m[j] > 0){
-				cv::Mat up, down;
-				std::vector<int> v = pointBackProjection(i, angle, s0, s1, up, down);
-				int l = v[0];
-				int r = v[1];
-				for (int k = l; k <= r; k++){
-					mask.at<char>(shift + up.at<int>(k - l, 0) - s0 / 2, k) |= flag;
-					mask.at<char>(shift + down.at<int>(k - l, 0) - s0 / 2, k) |= flag;
-				}
-			}
-			j++;
+		for (int i = 0; i < 2 * maxbin; i++){
+			weight[i] = m[j + i];
 		}
+		rasterizeBins(weight, maxbin, angle, s0, s1, shift, flag, mask, NULL);
 	}
 
 	//Functon used for profiling edge-shape of cradle pieces based on the Radon transform.
@@ -3226,28 +3831,14 @@ namespace CradleFunctions{
 	//Functon used for profiling edge-shape of cradle pieces based on the Radon transform.
 	//For more details and comments, look into the Matlab code, function getEdges()
 	cv::Mat getRadonforAngle(cv::Mat &d, cv::Mat &mask, double theta, int sx, int ex, int sy, int ey, int noflag){
-		int W = (ey - sy), H = (ex - sx);
-		int maxv = (int)(std::sqrt(W*W + H*H)) + 1;
-		double center_x = sy + W / 2;
-		double center_y = sx + H / 2;
-		cv::Mat acc(2 * maxv, 1, CV_32F, cv::Scalar(0));
+		std::vector<double> thetav(1, theta);
+		std::vector<float> proj;
+		int maxv = radonAccumulate(d, mask, thetav, sx, ex, sy, ey, noflag, proj);
 
-		//Normalize
-		if (theta < 0)
-			theta += 360;
-		if (theta > 360)
-			theta -= 360;
-
-		//Calculate Radon transform for single angle
-		for (int y = sx; y < sx + H; y++){
-			for (int x = sy; x < sy + W; x++){
-				if ((mask.at<char>(y, x) & noflag) == 0){
-					int r = (x - center_x) *1.0 * cos(RAD(theta)) - (y - center_y) *1.0 * sin(RAD(theta));
-					acc.at<float>((r + maxv), 0) = acc.at<float>((r + maxv), 0) + (d).at<float>(y, x);
-				}
-			}
+		cv::Mat acc(2 * maxv, 1, CV_32F);
+		for (int i = 0; i < 2 * maxv; i++){
+			acc.at<float>(i, 0) = proj[i];
 		}
-
 		return acc;
 	}
 
@@ -3318,32 +3909,14 @@ namespace CradleFunctions{
 	//   y_i = A + B*x_i + e_i with min(\sum_i (e_i)^2)
 	//where res[0] = A and res[1] = B
 	std::vector<float> linearFitting(std::vector<float> &x, std::vector<float> &y){
-		float mx, my, mxy, mxx;
-		mx = my = mxx = mxy = 0;
-
-		int N = 0;
-
-		for (int i = 0; i < x.size(); i++){
-			if (x[i] != -1 && y[i] != -1){
-				mx += x[i];
-				my += y[i];
-				N++;
-			}
-		}
-		mx /= N;
-		my /= N;
-
+		std::vector<float> cx, cy;
 		for (int i = 0; i < x.size(); i++){
 			if (x[i] != -1 && y[i] != -1){
-				mxy += (x[i] - mx)*(y[i] - my);
-				mxx += (x[i] - mx)*(x[i] - mx);
+				cx.push_back(x[i]);
+				cy.push_back(y[i]);
 			}
 		}
-		std::vector<float> res(2);
-
-		res[1] = mxy / mxx;
-		res[0] = my - res[1] * mx;
-		return res;
+		return linearFit(cx.data(), cy.data(), cx.size());
 	}
 
 	//Get the mean of the vector
@@ -3357,104 +3930,45 @@ namespace CradleFunctions{
 
 	//Get the mean of the matrix
 	float getMean(cv::Mat &im){
-		float s = 0;
-		for (int i = 0; i < im.rows; i++){
-			for (int j = 0; j < im.cols; j++){
-				s += im.at<float>(i, j);
-			}
-		}
-		return s / im.rows / im.cols;
+		return RobustStats::mean(im);
 	}
 
 	//Get the median of the matrix
 	float getMedian(cv::Mat &im){
-		std::vector<float> v(im.rows*im.cols);
-		int cnt = 0;
+		std::vector<float> v;
+		v.reserve(im.total());
 		for (int i = 0; i < im.rows; i++){
+			const float *p = im.ptr<float>(i);
 			for (int j = 0; j < im.cols; j++){
-				v[cnt] = im.at<float>(i, j);
-				cnt++;
+				if (p[j] != RobustStats::MISSING)
+					v.push_back(p[j]);
 			}
 		}
-		return getMedian(v);
+		return RobustStats::median(v);
 	}
 
 	//Get the median of the vector
 	float getMedian(std::vector<float> &v){
-		int s = v.size();
-		std::vector<float> mv(s);
-
-		int ts = 0;
-		for (int i = 0; i < s; i++){
-			if (v[i] != -1){
-				mv[ts] = v[i];
-				ts++;
-			}
-		}
-		if (ts == 0)
-			return -1;
-
-		mv.resize(ts);
-
-		std::sort(mv.begin(), mv.end());
-		s = ts;
-		if (s == 0)
-			return -1;
-		if (s % 2 == 1){
-			if (s == 1)
-				return mv[0];
-			else
-				return (mv[(s / 2)] + mv[(s / 2) + 1]) / 2;
-		}
-		else
-			return mv[(s / 2)];
+		std::vector<float> mv;
+		RobustStats::validSamples(v, mv);
+		return RobustStats::median(mv);
 	}
 
 	//Get the variance of the matrix
 	float getVariance(cv::Mat v){
-		float m = getMean(v);
-		float sum = 0;
-		for (int i = 0; i < v.rows; i++){
-			for (int j = 0; j < v.cols; j++){
-				float tmp = v.at<float>(i, j) - m;
-				sum += tmp * tmp;
-			}
-		}
-		return sum / v.rows / v.cols;
+		double mean, var;
+		RobustStats::meanVariance(v, mean, var);
+		return var;
 	}
 	
-	//Get the median of the vector
+	//Get the variance of the middle half of the valid samples of the vector
 	float getVariance(std::vector<float> &v){
-		int s = v.size();
-		std::vector<float> mv(s);
-
-		int ts = 0;
-		for (int i = 0; i < s; i++){
-			if (v[i] != -1){
-				mv[ts] = v[i];
-				ts++;
-			}
-		}
-		if (ts == 0)
-			return -1;
-
-		mv.resize(ts);
-		std::sort(mv.begin(), mv.end());
-
-		float mean = 0;
-		int cnt = 0;
-		for (int i = ts / 4; i < ts - ts / 4; i++){
-			mean += mv[i];
-			cnt++;
-		}
-		mean /= cnt;
-
-		float var = 0;
-		for (int i = ts / 4; i < ts - ts / 4; i++){
-			var += (mv[i] - mean) * (mv[i] - mean);
-		}
+		std::vector<float> mv;
+		RobustStats::validSamples(v, mv);
 
-		return var / cnt;
+		float mean, var;
+		RobustStats::trimmedMoments(mv, mean, var);
+		return var;
 	}
 
 	//Save out MarkedSegments structure 'ms' to a file 'name'
@@ -3486,19 +4000,20 @@ namespace CradleFunctions{
 			output << ms.piece_middle[i].x << " " << ms.piece_middle[i].y << std::endl;
 		}
 
-		//write out segment mask file
-		output << ms.piece_mask.rows << " " << ms.piece_mask.cols << std::endl;
-		for (int i = 0; i < ms.piece_mask.rows; i++){
+		//write out segment mask file, as (length, ID) runs of each row
+		CradleIntervals::Intervals iv = CradleIntervals::encode(cv::Mat(), ms.piece_mask);
+		output << iv.rows << " " << iv.cols << std::endl;
+		for (int i = 0; i < iv.rows; i++){
 			int j = 0;
-			while (j < ms.piece_mask.cols){
-				int v = ms.piece_mask.at<ushort>(i, j);
-				int ref = j;
-				j++;
-				while (j < ms.piece_mask.cols && ms.piece_mask.at<ushort>(i, j) == v){
-					j++;
-				}
-				output << (j - ref) << " " << v << " ";
-			}
+			for (int k = 0; k < iv.row[i].size(); k++){
+				const CradleIntervals::Run &run = iv.row[i][k];
+				if (run.start > j)
+					output << (run.start - j) << " " << 0 << " ";
+				output << (run.end - run.start) << " " << run.id << " ";
+				j = run.end;
+			}
+			if (j < iv.cols)
+				output << (iv.cols - j) << " " << 0 << " ";
 			output << std::endl;
 		}
 		output.close();
@@ -3545,22 +4060,25 @@ namespace CradleFunctions{
 			infile >> ms.piece_middle[i].x >> ms.piece_middle[i].y;
 		}
 
-		//mask segment file
+		//mask segment file, runs may continue on the next row
 		infile >> tmp1 >> tmp2;
-		ms.piece_mask = cv::Mat(tmp1, tmp2, CV_16U);
+		CradleIntervals::Intervals iv = CradleIntervals::create(tmp1, tmp2);
 		int ref = 0;
 		int i = 0;
 		while (infile >> tmp1){
 			infile >> tmp2;
-			for (int j = 0; j < tmp1; j++){
-				ms.piece_mask.at<ushort>(i, ref + j) = tmp2;
-			}
-			ref += tmp1;
-			if (ref >= ms.piece_mask.cols){
-				ref -= ms.piece_mask.cols;
-				i++;
+			while (tmp1 > 0 && i < iv.rows && iv.cols > 0){
+				int len = std::min(tmp1, iv.cols - ref);
+				CradleIntervals::append(iv, i, ref, ref + len, 0, tmp2);
+				ref += len;
+				tmp1 -= len;
+				if (ref >= iv.cols){
+					ref = 0;
+					i++;
+				}
 			}
 		}
+		CradleIntervals::rasterizePieces(iv, ms.piece_mask);
 		infile.close();
 		return ms;
 	}
@@ -0,0 +1,93 @@
+/*
+* Copyright (c) 2016, Gabor Adam Fodor <fogggab@yahoo.com>
+* All rights reserved.
+*
+* License:
+*
+* This program is provided for scientific and educational purposed only.
+* Feel free to use and/or modify it for such purposes, but you are kindly
+* asked not to redistribute this or derivative works in source or executable
+* form. A license must be obtained from the author of the code for any other use.
+*
+*/
+
+#include <platypus/CradleIntervals.h>
+#include <algorithm>
+
+/**
+* Run based cradle mask and piece map.
+**/
+
+namespace CradleIntervals{
+
+	Intervals create(int rows, int cols){
+		Intervals iv;
+		iv.rows = rows;
+		iv.cols = cols;
+		iv.row = std::vector<std::vector<Run>>(rows);
+		return iv;
+	}
+
+	Intervals encode(const cv::Mat &mask, const cv::Mat &piece_mask){
+		int rows = mask.empty() ? piece_mask.rows : mask.rows;
+		int cols = mask.empty() ? piece_mask.cols : mask.cols;
+		Intervals iv = create(rows, cols);
+
+		#pragma omp parallel for
+		for (int y = 0; y < rows; y++){
+			const uchar *mp = mask.empty() ? NULL : mask.ptr<uchar>(y);
+			const ushort *pp = piece_mask.empty() ? NULL : piece_mask.ptr<ushort>(y);
+			int x = 0;
+			while (x < cols){
+				uchar f = mp ? mp[x] : 0;
+				ushort id = pp ? pp[x] : 0;
+				int start = x;
+				x++;
+				while (x < cols && (mp ? mp[x] : 0) == f && (pp ? pp[x] : 0) == id)
+					x++;
+				if (f != 0 || id != 0)
+					iv.row[y].push_back({ start, x, f, id });
+			}
+		}
+		return iv;
+	}
+
+	const Run *find(const Intervals &iv, int y, int x){
+		const std::vector<Run> &r = iv.row[y];
+
+		//First run starting after x, the one before it is the only candidate
+		std::vector<Run>::const_iterator it = std::upper_bound(r.begin(), r.end(), x, [](int v, const Run &run){
+			return v < run.start;
+		});
+		if (it == r.begin())
+			return NULL;
+		--it;
+		return (x < it->end) ? &(*it) : NULL;
+	}
+
+	//Adds a run to the end of 'out', merging it with the last run if they touch and match; empty runs are dropped
+	static void push(std::vector<Run> &out, const Run &run){
+		if (run.start >= run.end || (run.flags == 0 && run.id == 0))
+			return;
+		if (!out.empty() && out.back().end == run.start && out.back().flags == run.flags && out.back().id == run.id)
+			out.back().end = run.end;
+		else
+			out.push_back(run);
+	}
+
+	void append(Intervals &iv, int y, int x0, int x1, uchar flags, ushort id){
+		push(iv.row[y], { x0, x1, flags, id });
+	}
+
+	void rasterizePieces(const Intervals &iv, cv::Mat &piece_mask){
+		piece_mask = cv::Mat(iv.rows, iv.cols, CV_16U, cv::Scalar(0));
+		#pragma omp parallel for
+		for (int y = 0; y < iv.rows; y++){
+			ushort *pp = piece_mask.ptr<ushort>(y);
+			for (int k = 0; k < iv.row[y].size(); k++){
+				const Run &run = iv.row[y][k];
+				std::fill(pp + run.start, pp + run.end, run.id);
+			}
+		}
+	}
+}
@@ -0,0 +1,133 @@
+/*
+* Copyright (c) 2016, Gabor Adam Fodor <fogggab@yahoo.com>
+* All rights reserved.
+*
+* License:
+*
+* This program is provided for scientific and educational purposed only.
+* Feel free to use and/or modify it for such purposes, but you are kindly
+* asked not to redistribute this or derivative works in source or executable
+* form. A license must be obtained from the author of the code for any other use.
+*
+*/
+
+#include <platypus/Random.h>
+#include <cmath>
+
+/**
+* Counter-based random number generation (Philox4x32-10).
+**/
+
+namespace Random{
+
+	const uint32_t PHILOX_M0 = 0xD2511F53;	//Round multipliers
+	const uint32_t PHILOX_M1 = 0xCD9E8D57;
+	const uint32_t PHILOX_W0 = 0x9E3779B9;	//Key schedule constants (Weyl sequence)
+	const uint32_t PHILOX_W1 = 0xBB67AE85;
+	const int PHILOX_ROUNDS = 10;			//Number of rounds
+
+	Stream stream(uint32_t seed, uint32_t piece, uint32_t iter, uint32_t site, uint32_t row){
+		Stream s;
+		s.key[0] = seed;
+		s.key[1] = piece;
+		s.ctr[0] = iter;
+		s.ctr[1] = site;
+		s.ctr[2] = row;
+		s.ctr[3] = 0;
+		s.pos = 4;	//Nothing generated yet
+		s.has_spare = false;
+		s.spare = 0;
+		return s;
+	}
+
+	void philox(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]){
+		uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+		uint32_t k0 = key[0], k1 = key[1];
+
+		for (int r = 0; r < PHILOX_ROUNDS; r++){
+			if (r > 0){
+				//Bump key
+				k0 += PHILOX_W0;
+				k1 += PHILOX_W1;
+			}
+
+			uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+			uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+
+			uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+			uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+			c1 = (uint32_t)p1;
+			c3 = (uint32_t)p0;
+			c0 = n0;
+			c2 = n2;
+		}
+
+		out[0] = c0;
+		out[1] = c1;
+		out[2] = c2;
+		out[3] = c3;
+	}
+
+	uint32_t next(Stream &s){
+		if (s.pos == 4){
+			//Generate next block
+			philox(s.ctr, s.key, s.buf);
+			s.ctr[3]++;
+			s.pos = 0;
+		}
+		return s.buf[s.pos++];
+	}
+
+	double uniform(Stream &s){
+		return (next(s) + 0.5) * (1.0 / 4294967296.0);
+	}
+
+	int uniformInt(Stream &s, int n){
+		return (int)(((uint64_t)next(s) * (uint64_t)n) >> 32);
+	}
+
+	float normal(Stream &s, float mean, float sd){
+		if (s.has_spare){
+			s.has_spare = false;
+			return mean + sd * s.spare;
+		}
+
+		//Box-Muller transform, keep the second value for the next call
+		double u1 = uniform(s);
+		double u2 = uniform(s);
+		double r = std::sqrt(-2.0 * std::log(u1));
+		double a = 2 * 3.14159265358979323846 * u2;
+
+		s.spare = (float)(r * std::sin(a));
+		s.has_spare = true;
+		return mean + sd * (float)(r * std::cos(a));
+	}
+
+	float gamma(Stream &s, float shape, float scale){
+		if (shape < 1){
+			//Boost shape by one, then scale back: G(a) = G(a + 1) * U^(1/a)
+			double u = uniform(s);
+			return gamma(s, shape + 1, scale) * (float)std::pow(u, 1.0 / shape);
+		}
+
+		double d = shape - 1.0 / 3;
+		double c = 1.0 / std::sqrt(9 * d);
+
+		while (true){
+			double x, v;
+			do{
+				x = normal(s, 0, 1);
+				v = 1 + c * x;
+			} while (v <= 0);
+
+			v = v * v * v;
+			double u = uniform(s);
+
+			//Squeeze, then full acceptance test
+			if (u < 1 - 0.0331 * x * x * x * x)
+				return (float)(d * v * scale);
+			if (std::log(u) < 0.5 * x * x + d * (1 - v + std::log(v)))
+				return (float)(d * v * scale);
+		}
+	}
+}
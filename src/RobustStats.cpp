@@ -0,0 +1,131 @@
+/*
+* Copyright (c) 2016, Gabor Adam Fodor <fogggab@yahoo.com>
+* All rights reserved.
+*
+* License:
+*
+* This program is provided for scientific and educational purposed only.
+* Feel free to use and/or modify it for such purposes, but you are kindly
+* asked not to redistribute this or derivative works in source or executable
+* form. A license must be obtained from the author of the code for any other use.
+*
+*/
+
+#include <platypus/RobustStats.h>
+#include <algorithm>
+
+/**
+* Selection based medians and trimmed moments, single pass image moments.
+**/
+
+namespace RobustStats{
+
+	int validSamples(const std::vector<float> &v, std::vector<float> &out){
+		out.clear();
+		out.reserve(v.size());
+		for (int i = 0; i < v.size(); i++){
+			if (v[i] != MISSING)
+				out.push_back(v[i]);
+		}
+		return out.size();
+	}
+
+	float select(std::vector<float> &v, int k){
+		std::nth_element(v.begin(), v.begin() + k, v.end());
+		return v[k];
+	}
+
+	float median(std::vector<float> &v){
+		int n = v.size();
+		if (n == 0)
+			return MISSING;
+
+		float m = select(v, n / 2);
+		if (n % 2 == 1 && n > 1){
+			//Next sample is the smallest one above the middle
+			return (m + *std::min_element(v.begin() + n / 2 + 1, v.end())) / 2;
+		}
+		return m;
+	}
+
+	void trimmedMoments(std::vector<float> &v, float &mean, float &var){
+		int n = v.size();
+		if (n == 0){
+			mean = var = MISSING;
+			return;
+		}
+
+		//Bring the middle half of the samples to [lo, hi)
+		int lo = n / 4;
+		int hi = n - n / 4;
+		std::nth_element(v.begin(), v.begin() + lo, v.end());
+		if (hi < n)
+			std::nth_element(v.begin() + lo, v.begin() + hi, v.end());
+
+		double s = 0;
+		for (int i = lo; i < hi; i++){
+			s += v[i];
+		}
+		double mu = s / (hi - lo);
+
+		double s2 = 0;
+		for (int i = lo; i < hi; i++){
+			s2 += (v[i] - mu) * (v[i] - mu);
+		}
+		mean = mu;
+		var = s2 / (hi - lo);
+	}
+
+	double mean(const cv::Mat &m){
+		if (m.empty())
+			return 0;
+
+		double s = 0;
+		for (int i = 0; i < m.rows; i++){
+			const float *p = m.ptr<float>(i);
+			double rs = 0;
+			#pragma omp simd reduction(+:rs)
+			for (int j = 0; j < m.cols; j++){
+				rs += p[j];
+			}
+			s += rs;
+		}
+		return s / m.rows / m.cols;
+	}
+
+	void meanVariance(const cv::Mat &m, double &mean, double &var){
+		mean = var = 0;
+		if (m.empty())
+			return;
+
+		double n = 0, mu = 0, m2 = 0;
+		for (int i = 0; i < m.rows; i++){
+			const float *p = m.ptr<float>(i);
+
+			//Moments of the row, in two passes over data that stays in cache
+			double rs = 0;
+			#pragma omp simd reduction(+:rs)
+			for (int j = 0; j < m.cols; j++){
+				rs += p[j];
+			}
+			double rmu = rs / m.cols;
+
+			double rm2 = 0;
+			#pragma omp simd reduction(+:rm2)
+			for (int j = 0; j < m.cols; j++){
+				double d = p[j] - rmu;
+				rm2 += d * d;
+			}
+
+			//Merge with the rows above
+			double nr = m.cols;
+			double nt = n + nr;
+			double delta = rmu - mu;
+			mu += delta * nr / nt;
+			m2 += rm2 + delta * delta * n * nr / nt;
+			n = nt;
+		}
+		mean = mu;
+		var = m2 / n;
+	}
+}
@@ -13,10 +13,15 @@
 
 #include <platypus/TextureRemoval.h>
 #include <platypus/CradleFunctions.h>
+#include <platypus/CradleIntervals.h>
 #include <platypus/MCA.h>
 #include <platypus/FFST.h>
+#include <platypus/Random.h>
 #include <opencv2/flann.hpp>
-#include <random>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define PI 3.1415927
 
@@ -33,10 +38,41 @@ namespace TextureRemoval{
 	const int SEED = 1;				//Constant seed for random number generators (to guarantee reproductibility)
 	const int SN = 4;				//Sub-sampling factor for rows
 	const int SM = 4;				//Sub-sampling factor for columns
-	const int PSN = 9;				//Sub-sampling factor for rows for clustering
-	const int PSM = 9;				//Sub-sampling factor for columns for clustering
+	const int codebook_size = 4096;	//Maximum number of training samples used as nearest-neighbour codebook of a model
+	const int nn_search = NN_KDTREE;	//Nearest-neighbour search method used for separation (NN_KDTREE or NN_BRUTEFORCE)
 	const int NR_NEIGHBOURS = 5;	//Nr neighbors for Nearest-neighbour (NN) search	
 	const int max_samples = 10000;	//Maximum number of samples to be processed for the post-inference algo
+	const size_t training_memory = (size_t)2 << 30;	//Memory budget (bytes) shared by concurrently running model trainings
+
+	//Random stream sites, each place drawing random numbers gets its own counter space
+	const int RS_INIT_PSIJH1 = 0;		//Initial psijh1
+	const int RS_INIT_DELTA1 = 1;		//Initial delta1
+	const int RS_INIT_PSIJH2 = 2;		//Initial psijh2
+	const int RS_INIT_DELTA2 = 3;		//Initial delta2
+	const int RS_INIT_KAPPA = 4;		//Initial kappa
+	const int RS_INIT_XI = 5;			//Initial xi
+	const int RS_ETA_NC = 6;			//Non-cradle eta update
+	const int RS_ETA_C = 7;				//Cradle eta update
+	const int RS_LAMBDA = 8;			//Lambda update
+	const int RS_PSIJH1 = 9;			//psijh1 update
+	const int RS_DELTA1 = 10;			//delta1 update
+	const int RS_XI = 11;				//xi update
+	const int RS_KAPPA = 12;			//kappa update
+	const int RS_GAMMA = 13;			//Gamma update
+	const int RS_PSIJH2 = 14;			//psijh2 update
+	const int RS_DELTA2 = 15;			//delta2 update
+	const int RS_ADAPT1 = 16;			//Non-cradle adaptation decision
+	const int RS_EXPAND_ETA_C = 17;		//New column of eta_c
+	const int RS_EXPAND_ETA_NC = 18;	//New column of eta_nc
+	const int RS_EXPAND_PSIJH1 = 19;	//New column of psijh1
+	const int RS_EXPAND_DELTA1 = 20;	//New element of delta1
+	const int RS_ADAPT2 = 21;			//Cradle adaptation decision
+	const int RS_EXPAND_KAPPA = 22;		//New element of kappa
+	const int RS_EXPAND_XI = 23;		//New column of xi
+	const int RS_EXPAND_PSIJH2 = 24;	//New column of psijh2
+	const int RS_EXPAND_DELTA2 = 25;	//New element of delta2
+	const int RS_SUBSAMPLE = 26;		//Data set sub-sampling
+	const int RS_CODEBOOK = 27;			//Codebook selection
 
 	//Shearlet decomposition horizontal/vertical angle parameters
 	int target_v[] = { 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1 };
@@ -46,6 +82,51 @@ namespace TextureRemoval{
 	//Used as buffer for file writing/reading
 	float buffer[block_size*block_size];
 
+	//Rough upper estimate of the memory (bytes) used by gibbsSampling() on a data set of the given size
+	size_t trainingFootprint(size_t ncradle, size_t nnoncradle, int p){
+		size_t k2 = std::floor(std::log(p) * 3);
+		//Sample matrices, eta/xi factors and their temporaries, all kept as floats
+		return 3 * sizeof(float) * (ncradle + nnoncradle) * (2 * p + k2);
+	}
+
+	//Select at most 'cnt' of the samples as codebook, uniformly at random from the random stream of the piece
+	//(the samples are in scan order unless the reservoir overflowed, so taking the first ones would favour the top blocks)
+	static void selectCodebook(const std::vector<std::vector<float>> &samples, std::vector<std::vector<float>> &codebook, int cnt, int piece){
+		int n = samples.size();
+		if (n <= cnt){
+			codebook = samples;
+			return;
+		}
+
+		//Partial Fisher-Yates shuffle of the sample indices
+		std::vector<int> ind(n);
+		for (int i = 0; i < n; i++)
+			ind[i] = i;
+		Random::Stream rs = Random::stream(SEED, piece, 0, RS_CODEBOOK, 0);
+		codebook = std::vector<std::vector<float>>(cnt);
+		for (int i = 0; i < cnt; i++){
+			std::swap(ind[i], ind[i + Random::uniformInt(rs, n - i)]);
+			codebook[i] = samples[ind[i]];
+		}
+	}
+
+	//Index in [0, n) mirrored onto by index p of a BORDER_REFLECT padded axis (p relative to the unpadded start)
+	static inline int reflectIndex(int p, int n){
+		while (p < 0 || p >= n){
+			if (p < 0)
+				p = -p - 1;
+			else
+				p = 2 * n - p - 1;
+		}
+		return p;
+	}
+
+	//Run of the mask flags/piece IDs under pixel (i, j) of the image padded by overlap / 2 pixels on each side,
+	//NULL if the pixel has no flags and is not part of a cradle piece
+	static inline const CradleIntervals::Run *paddedRun(const CradleIntervals::Intervals &runs, int i, int j){
+		return CradleIntervals::find(runs, reflectIndex(i - overlap / 2, runs.rows), reflectIndex(j - overlap / 2, runs.cols));
+	}
+
 	//Entry point to texture separation
 	void textureRemove(
 		cv::Mat &img,								//Input image for wood grain separation
@@ -55,14 +136,11 @@ namespace TextureRemoval{
 	){
 
 		//Create borders for image
-		cv::Mat in, mask, piecemark;
+		cv::Mat in;
 		cv::copyMakeBorder(img, in, overlap / 2, overlap / 2, overlap / 2, overlap / 2, cv::BORDER_REFLECT);
 
-		//Create borders for mask
-		cv::copyMakeBorder(mask_orig, mask, overlap / 2, overlap / 2, overlap / 2, overlap / 2, cv::BORDER_REFLECT);
-
-		//Create border for piece mask
-		cv::copyMakeBorder(ms.piece_mask, piecemark, overlap / 2, overlap / 2, overlap / 2, overlap / 2, cv::BORDER_REFLECT);
+		//Mask flags and piece IDs as runs of the unpadded rows, read through paddedRun() instead of padded copies
+		CradleIntervals::Intervals runs = CradleIntervals::encode(mask_orig, ms.piece_mask);
 
 		int N = in.rows;
 		int M = in.cols;
@@ -124,12 +202,14 @@ namespace TextureRemoval{
 			#pragma omp flush (canceled)
 			if (!canceled)
 			{
-				#pragma omp atomic
-				processed = (int)(l * 10/ coords.size());
+				//Report the stored value instead of re-reading the shared counter
+				int done = (int)(l * 10/ coords.size());
+				#pragma omp atomic write
+				processed = done;
 			
 				// progress/abort
 				#pragma omp critical
-				if (!CradleFunctions::progress(processed, tot_progress))
+				if (!CradleFunctions::progress(done, tot_progress))
 					canceled = true;
 
 				if (!canceled)
@@ -174,15 +254,14 @@ namespace TextureRemoval{
 		cv::Mat new_texture = cv::Mat(texture.rows, texture.cols, CV_32F, cv::Scalar(0));
 		processed = 10;
 
-		//Create huge arrays of cradle/non-cradle sampled coefficients
-		std::vector<std::vector<float>> full_samples(in.rows * in.cols);
-		std::vector<int> sample_index(in.rows * in.cols);
-
-		//Index for sample position within array
-		int fsample_pos = 0;
-
 		//Type of sampled piece (horizontal/vertical/cross section)
 		std::vector<int> sample_type(ms.pieceIDh.size() + ms.pieceIDv.size() + 2);
+
+		//Random selection of at most max_samples cradle/non-cradle coefficients for each piece, filled while sweeping the blocks
+		std::vector<SampleReservoir> reservoirs(sample_type.size());
+		for (int i = 0; i < reservoirs.size(); i++){
+			reservoirs[i] = createReservoir(max_samples, target_dim, i);
+		}
 		
 		//Mark cradle directions
 		for (int i = 0; i < ms.pieceIDh.size(); i++){
@@ -237,10 +316,12 @@ namespace TextureRemoval{
 
 				//Add points to training set
 				for (int i = 0; i < cex - csx; i += SN){
-					for (int j = 0; j < cey - csy; j += SM) if ((mask.at<char>(i + csx, j + csy) & CradleFunctions::DEFECT) != CradleFunctions::DEFECT) {
+					for (int j = 0; j < cey - csy; j += SM) {
+						const CradleIntervals::Run *run = paddedRun(runs, i + csx, j + csy);
+						if (run && (run->flags & CradleFunctions::DEFECT) == CradleFunctions::DEFECT)
+							continue;
 
-						ushort pi = piecemark.at<ushort>(i + csx, j + csy) + 1;	//Index of the piece
-						int coeff_size = target_dim;
+						ushort pi = (run ? run->id : 0) + 1;	//Index of the piece
 
 						if (pi > 1){
 
@@ -256,18 +337,18 @@ namespace TextureRemoval{
 
 							if (hi != -1){
 								//Add sample to horizontal piece
-								full_samples[fsample_pos] = std::vector<float>(coeff_size);
-								sample_index[fsample_pos] = hi;
+								std::vector<float> *sample = reserveSample(reservoirs[hi]);
 								sample_type[hi] = CradleFunctions::HORIZONTAL_DIR;
 								block_used[hi][z] = 1;
 
 								//Fill up sample - horizontal
-								int lindex = 0;
-								for (int l = 0; l < 61; l++) if (target_h[l] == 1){
-									full_samples[fsample_pos][lindex] = coeffs[l].at<float>(i, j);
-									lindex++;
+								if (sample != NULL){
+									int lindex = 0;
+									for (int l = 0; l < 61; l++) if (target_h[l] == 1){
+										(*sample)[lindex] = coeffs[l].at<float>(i, j);
+										lindex++;
+									}
 								}
-								fsample_pos++;
 							}
 
 							//Find horizontal cradle containing this segment (if any)
@@ -281,48 +362,47 @@ namespace TextureRemoval{
 							}
 							if (vi != -1){
 								//Add sample to vertical piece
-								full_samples[fsample_pos] = std::vector<float>(coeff_size);
-								sample_index[fsample_pos] = vi;
+								std::vector<float> *sample = reserveSample(reservoirs[vi]);
 								sample_type[vi] = CradleFunctions::VERTICAL_DIR;
 								block_used[vi][z] = 1;
 
 								///Fill up sample - vertical
-								int lindex = 0;
-								for (int l = 0; l < 61; l++) if (target_v[l] == 1){
-									full_samples[fsample_pos][lindex] = coeffs[l].at<float>(i, j);
-									lindex++;
+								if (sample != NULL){
+									int lindex = 0;
+									for (int l = 0; l < 61; l++) if (target_v[l] == 1){
+										(*sample)[lindex] = coeffs[l].at<float>(i, j);
+										lindex++;
+									}
 								}
-								fsample_pos++;
 							}
 						}
 						else{
 							//No horizontal or vertical mask piece present
 							pi = 0;	//Horizontal non-cradle index
-							int coeff_size = target_dim;
-							full_samples[fsample_pos] = std::vector<float>(coeff_size);
-							sample_index[fsample_pos] = pi;
+							std::vector<float> *sample = reserveSample(reservoirs[pi]);
 							block_used[pi][z] = 1;
 
 							//Fill up sample - horizontal
-							int lindex = 0;
-							for (int l = 0; l < 61; l++) if (target_h[l] == 1){
-								full_samples[fsample_pos][lindex] = coeffs[l].at<float>(i, j);
-								lindex++;
+							if (sample != NULL){
+								int lindex = 0;
+								for (int l = 0; l < 61; l++) if (target_h[l] == 1){
+									(*sample)[lindex] = coeffs[l].at<float>(i, j);
+									lindex++;
+								}
 							}
-							fsample_pos++;
 
 							pi = 1;	//Vertical non-cradle index
-							full_samples[fsample_pos] = std::vector<float>(coeff_size);
-							sample_index[fsample_pos] = pi;
+							sample = reserveSample(reservoirs[pi]);
 							block_used[pi][z] = 1;
 
 							//Fill up sample - vertical
-							lindex = 0;
-							for (int l = 0; l < 61; l++) if (target_v[l] == 1){
-								full_samples[fsample_pos][lindex] = coeffs[l].at<float>(i, j);
-								lindex++;
+							if (sample != NULL){
+								int lindex = 0;
+								for (int l = 0; l < 61; l++) if (target_v[l] == 1){
+									(*sample)[lindex] = coeffs[l].at<float>(i, j);
+									lindex++;
+								}
 							}
-							fsample_pos++;
 						}
 					}
 				}
@@ -331,423 +411,385 @@ namespace TextureRemoval{
 		processed++;
 		if (canceled)
 			return;
-		full_samples.resize(fsample_pos);
 
-		std::vector<int> sample_pos(sample_type.size());
+		//Take over the randomly selected samples of each piece
 		std::vector<std::vector<std::vector<float>>> sample_select(sample_type.size());
-
-		//Randomly select samples to reduce computation time
 		for (int i = 0; i < sample_select.size(); i++){
-			int local_pos = 0;
-			std::vector<std::vector<float>> local(full_samples.size());
-			//Find all samples with corresponding number
-			for (int j = 0; j < full_samples.size(); j++){
-				if (sample_index[j] == i){
-					//Copy sample to local selection
-					local[local_pos] = std::vector<float>(full_samples[j].size());
-					for (int k = 0; k < full_samples[j].size(); k++){
-						local[local_pos][k] = full_samples[j][k];
-					}
-					local_pos++;
-				}
-			}
-
-			//Resize
-			local.resize(local_pos);
-
-			//Sample randomly
-			sampleDataset(local, sample_select[i], max_samples);
+			sample_select[i].swap(reservoirs[i].samples);
 		}
-
-		//Drop global selection of coefficients to save memory
-		full_samples.clear();
-		sample_index.clear();
+		reservoirs.clear();
 
 		//Normalize non-cradled components
 		std::vector<float> mean_h, mean_v, var_h, var_v;
 		normalizeNonCradle(sample_select[0], mean_h, var_h);	//Get normalization of horizontal non-cradle samples
 		normalizeNonCradle(sample_select[1], mean_v, var_v);	//Get normalization of vertical non-cradle samples
 
-		//Train separation model on each cradle piece
-		cradle_model_fitting model;
-
+		//Normalize the cradle samples of every piece, training data are independent from here on
 		for (int mod_sel = 2; mod_sel < sample_select.size(); mod_sel++){
-
 			if (sample_select[mod_sel].size() != 0){
-
-				#pragma omp atomic
-				processed++;
-
-				std::vector<std::vector<float>> ncdata;	//Non-cradle data samples
-
-				//Normalize the data & choose reference non-cradle data set
 				if (sample_type[mod_sel] == CradleFunctions::HORIZONTAL_DIR){
 					normalizeSamples(sample_select[mod_sel], mean_h, var_h);
-					ncdata = sample_select[0];
 				}
 				else if (sample_type[mod_sel] == CradleFunctions::VERTICAL_DIR){
 					normalizeSamples(sample_select[mod_sel], mean_v, var_v);
-					ncdata = sample_select[1];
-				}else{
-					//Cross section
 				}
+			}
+		}
 
-				//Train the model
-				model = gibbsSampling(sample_select[mod_sel], ncdata);
-				
-				cv::Mat new_texture;
-				texture.copyTo(new_texture);
+		//Number of models trained at the same time, bounded by the thread count and the memory budget
+		size_t max_footprint = 1;
+		for (int mod_sel = 2; mod_sel < sample_select.size(); mod_sel++){
+			int nc_sel = (sample_type[mod_sel] == CradleFunctions::VERTICAL_DIR) ? 1 : 0;
+			max_footprint = std::max(max_footprint, trainingFootprint(sample_select[mod_sel].size(), sample_select[nc_sel].size(), target_dim));
+		}
+		int train_slots = (int)std::max((size_t)1, training_memory / max_footprint);
+#ifdef _OPENMP
+		train_slots = std::min(train_slots, omp_get_max_threads());
+#endif
+
+		//Trained models, released once the piece has been separated
+		std::vector<cradle_model_fitting> models(sample_select.size());
+
+		//Task dependency tokens: ready[i] is written by the training of piece i, separated serializes the separations
+		std::vector<char> model_ready(sample_select.size());
+		char *ready = model_ready.data();
+		char separated = 0;
+
+		//Pieces whose training has been started, in order
+		std::vector<int> trained;
+
+		//Train separation model on each cradle piece. Trainings run concurrently (at most train_slots at a time),
+		//separation of a piece starts as soon as its model is ready, but pieces are separated in order,
+		//as each one works on the texture left by the previous one.
+		#pragma omp parallel
+		#pragma omp single
+		for (int mod_sel = 2; mod_sel < sample_select.size(); mod_sel++){
 
-				// progress/abort
-				#pragma omp critical
-				if (!CradleFunctions::progress(processed, tot_progress))
-					canceled = true;
+			if (sample_select[mod_sel].size() != 0){
 
-				#pragma omp parallel for
-				//Separate coefficients over entire image
-				for (int z = 0; z < coords.size(); z++) if (block_used[mod_sel][z] == 1){
+				//Wait for the training started train_slots pieces earlier (ready[0] is never written)
+				int wait_for = (trained.size() >= train_slots) ? trained[trained.size() - train_slots] : 0;
+				trained.push_back(mod_sel);
 
+				#pragma omp task depend(in: ready[wait_for]) depend(out: ready[mod_sel])
+				{
+					#pragma omp flush (canceled)
 					if (!canceled){
+						//Choose reference non-cradle data set
+						std::vector<std::vector<float>> &ncdata = (sample_type[mod_sel] == CradleFunctions::VERTICAL_DIR) ? sample_select[1] : sample_select[0];
 
-						int sx = coords[z][0];
-						int sy = coords[z][1];
-						int ex = coords[z][2];
-						int ey = coords[z][3];
-
-						//Get reference coordinates
-						int csx = sx, cex = ex, csy = sy, cey = ey;
-						if (sx != 0)
-							csx += overlap / 2;
-						if (sy != 0)
-							csy += overlap / 2;
-						if (ex != N)
-							cex -= overlap / 2;
-						if (ey != M)
-							cey -= overlap / 2;
-
-						std::vector<cv::Mat> coeffs;
-						//Block to work on
-						cv::Mat selection = cv::Mat(block_size, block_size, CV_32F, cv::Scalar(0));
-						for (int i = sx; i < ex; i++){
-							for (int j = sy; j < ey; j++){
-								selection.at<float>(i - sx, j - sy) = texture.at<float>(i, j);
-							}
-						}
-
-						//Save decomposition results to structure
-						coeffs = FFST::shearletTransformSpect(selection);
-						
-						//Use this to store samples
-						std::vector<std::vector<float>> clusters(block_size * block_size / PSN / PSM * 2);
-						int sample_pos = 0;
-
-						//Subsample coefficients for clustering
-						for (int i = 0; i < ex - sx; i += PSN){
-							for (int j = 0; j < ey - sy; j += PSM) if ((mask.at<char>(i + sx, j + sy) & CradleFunctions::DEFECT) != CradleFunctions::DEFECT){
-
-								int pi = piecemark.at<ushort>(i + sx, j + sy) + 1;	//Index of the piece
-								int coeff_size = target_dim;
-
-								if (pi > 1){
-									int ci;
-									bool partOfCradle = false;
-
-									if (mod_sel >= 2 + ms.pieceIDh.size()){
-										//It's a vertical cradle piece
-										ci = mod_sel - 2 - ms.pieceIDh.size();
+						//Train the model
+						models[mod_sel] = gibbsSampling(sample_select[mod_sel], ncdata, STORE_INFERENCE, mod_sel);
+					}
+				}
 
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDv[ci].size(); temp++){
-											if (ms.pieceIDv[ci][temp] == pi - 1)
-												partOfCradle = true;
-										}
+				#pragma omp task depend(in: ready[mod_sel]) depend(inout: separated)
+				{
+					#pragma omp atomic
+					processed++;
 
-										//Apply vertical separation
-										if (partOfCradle){
-											clusters[sample_pos] = std::vector<float>(coeff_size);
+					// progress/abort
+					#pragma omp critical
+					if (!CradleFunctions::progress(processed, tot_progress))
+						canceled = true;
 
-											//Fill up sample - vertical
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_v[l] == 1){
-												clusters[sample_pos][lindex] = coeffs[l].at<float>(i, j);
-												lindex++;
-											}
-											sample_pos++;
-										}
-
-									}
-									else{
-										//It's a horizontal cradle piece
-										ci = mod_sel - 2;
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDh[ci].size(); temp++){
-											if (ms.pieceIDh[ci][temp] == pi - 1)
-												partOfCradle = true;
-										}
+					cradle_model_fitting &model = models[mod_sel];
+					std::vector<std::vector<float>> ncdata;	//Non-cradle data samples
 
-										//Apply horizontal separation
-										if (partOfCradle){
-											clusters[sample_pos] = std::vector<float>(coeff_size);
+					//Choose reference non-cradle data set
+					if (sample_type[mod_sel] == CradleFunctions::HORIZONTAL_DIR){
+						ncdata = sample_select[0];
+					}
+					else if (sample_type[mod_sel] == CradleFunctions::VERTICAL_DIR){
+						ncdata = sample_select[1];
+					}else{
+						//Cross section
+					}
 
-											//Fill up samle - horizontal
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_h[l] == 1){
-												clusters[sample_pos][lindex] = coeffs[l].at<float>(i, j);
-												lindex++;
-											}
-											sample_pos++;
-										}
-									}
-								}
+					//Codebook of the model: its (normalized) training samples, separated once with the full model
+					//Coefficients of all blocks are separated by interpolating the separation of their nearest codebook points
+					std::vector<std::vector<float>> codebook;
+					selectCodebook(sample_select[mod_sel], codebook, codebook_size, mod_sel);
+					int ncodebook = codebook.size();
+					std::vector<std::vector<float>> codebook_diffs;
+					NeighbourIndex index;
+					bool clustering = ncodebook >= NR_NEIGHBOURS;
+
+					if (clustering && !canceled){
+						post_inference(model, codebook, ncdata, codebook_diffs);
+
+						cv::Mat codebook_mat(ncodebook, target_dim, CV_32F);
+						for (int i = 0; i < codebook_mat.rows; i++){
+							for (int j = 0; j < codebook_mat.cols; j++){
+								codebook_mat.at<float>(i, j) = codebook[i][j];
 							}
 						}
-						//Drop unused elements
-						clusters.resize(sample_pos);
-						bool clustering;
-						cv::flann::GenericIndex< cvflann::L2<float> > *kdTree; // The flann KD searching tree
-
-						cv::Mat clusters_mat(clusters.size(), clusters[0].size(), CV_32F);
-						if (clusters.size() > 0){
-							cv::Mat clusters_mat(clusters.size(), clusters[0].size(), CV_32F);
-							for (int i = 0; i < clusters_mat.rows; i++){
-								for (int j = 0; j < clusters_mat.cols; j++){
-									clusters_mat.at<float>(i, j) = clusters[i][j];
+						buildNeighbourIndex(index, codebook_mat, nn_search);
+					}
+
+					cv::Mat new_texture;
+					texture.copyTo(new_texture);
+
+					#pragma omp taskloop default(shared)
+					//Separate coefficients over entire image
+					for (int z = 0; z < coords.size(); z++) if (block_used[mod_sel][z] == 1){
+
+						if (!canceled){
+
+							int sx = coords[z][0];
+							int sy = coords[z][1];
+							int ex = coords[z][2];
+							int ey = coords[z][3];
+
+							//Get reference coordinates
+							int csx = sx, cex = ex, csy = sy, cey = ey;
+							if (sx != 0)
+								csx += overlap / 2;
+							if (sy != 0)
+								csy += overlap / 2;
+							if (ex != N)
+								cex -= overlap / 2;
+							if (ey != M)
+								cey -= overlap / 2;
+
+							std::vector<cv::Mat> coeffs;
+							//Block to work on
+							cv::Mat selection = cv::Mat(block_size, block_size, CV_32F, cv::Scalar(0));
+							for (int i = sx; i < ex; i++){
+								for (int j = sy; j < ey; j++){
+									selection.at<float>(i - sx, j - sy) = texture.at<float>(i, j);
 								}
 							}
-							clustering = true;
-						}
-						else{
-							clustering = false;
-						}
-
-						//Create KD Tree
-						kdTree = new cv::flann::GenericIndex< cvflann::L2<float> >(clusters_mat, cvflann::KDTreeIndexParams(4));
 
-						//Post inference for subsampled coefficients
-						std::vector<std::vector<float>> clusters_diffs;
-						post_inference(model, clusters, ncdata, clusters_diffs);
+							//Save decomposition results to structure
+							coeffs = FFST::shearletTransformSpect(selection);
 						
-						//Look up all coefficients
-						sample_pos = 0;
-						std::vector<std::vector<float>> samples(block_size * block_size);
-						for (int i = 0; i < ex - sx; i++){
-							for (int j = 0; j < ey - sy; j++) if ((mask.at<char>(i + sx, j + sy) & CradleFunctions::DEFECT) != CradleFunctions::DEFECT){
-
-								int pi = piecemark.at<ushort>(i + sx, j + sy) + 1;	//Index of the piece
-								int coeff_size = target_dim;
-
-								if (pi > 1){
-									int ci;
-									bool partOfCradle = false;
-
-									if (mod_sel >= 2 + ms.pieceIDh.size()){
-										//It's a vertical cradle piece
-										ci = mod_sel - 2 - ms.pieceIDh.size();
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDv[ci].size(); temp++){
-											if (ms.pieceIDv[ci][temp] == pi - 1)
-												partOfCradle = true;
-										}
-
-										//Apply vertical separation
-										if (partOfCradle){
-											samples[sample_pos] = std::vector<float>(coeff_size);
+							//Look up all coefficients
+							int sample_pos = 0;
+							std::vector<std::vector<float>> samples(block_size * block_size);
+							for (int i = 0; i < ex - sx; i++){
+								for (int j = 0; j < ey - sy; j++) {
+									const CradleIntervals::Run *run = paddedRun(runs, i + sx, j + sy);
+									if (run && (run->flags & CradleFunctions::DEFECT) == CradleFunctions::DEFECT)
+										continue;
+
+									int pi = (run ? run->id : 0) + 1;	//Index of the piece
+									int coeff_size = target_dim;
+
+									if (pi > 1){
+										int ci;
+										bool partOfCradle = false;
+
+										if (mod_sel >= 2 + ms.pieceIDh.size()){
+											//It's a vertical cradle piece
+											ci = mod_sel - 2 - ms.pieceIDh.size();
+
+											//Check if segment is part of the cradle
+											for (int temp = 0; temp < ms.pieceIDv[ci].size(); temp++){
+												if (ms.pieceIDv[ci][temp] == pi - 1)
+													partOfCradle = true;
+											}
 
-											//Fill up sample - vertical
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_v[l] == 1){
-												samples[sample_pos][lindex] = coeffs[l].at<float>(i, j);
-												lindex++;
+											//Apply vertical separation
+											if (partOfCradle){
+												samples[sample_pos] = std::vector<float>(coeff_size);
+
+												//Fill up sample - vertical
+												int lindex = 0;
+												for (int l = 0; l < 61; l++) if (target_v[l] == 1){
+													samples[sample_pos][lindex] = coeffs[l].at<float>(i, j);
+													lindex++;
+												}
+												sample_pos++;
 											}
-											sample_pos++;
-										}
 
-									}
-									else{
-										//It's a horizontal cradle piece
-										ci = mod_sel - 2;
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDh[ci].size(); temp++){
-											if (ms.pieceIDh[ci][temp] == pi - 1)
-												partOfCradle = true;
 										}
+										else{
+											//It's a horizontal cradle piece
+											ci = mod_sel - 2;
+
+											//Check if segment is part of the cradle
+											for (int temp = 0; temp < ms.pieceIDh[ci].size(); temp++){
+												if (ms.pieceIDh[ci][temp] == pi - 1)
+													partOfCradle = true;
+											}
 
-										//Apply horizontal separation
-										if (partOfCradle){
-											samples[sample_pos] = std::vector<float>(coeff_size);
-
-											//Fill up samle - horizontal
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_h[l] == 1){
-												samples[sample_pos][lindex] = coeffs[l].at<float>(i, j);
-												lindex++;
+											//Apply horizontal separation
+											if (partOfCradle){
+												samples[sample_pos] = std::vector<float>(coeff_size);
+
+												//Fill up samle - horizontal
+												int lindex = 0;
+												for (int l = 0; l < 61; l++) if (target_h[l] == 1){
+													samples[sample_pos][lindex] = coeffs[l].at<float>(i, j);
+													lindex++;
+												}
+												sample_pos++;
 											}
-											sample_pos++;
 										}
 									}
 								}
 							}
-						}
-						//Drop unused elements
-						samples.resize(sample_pos);
+							//Drop unused elements
+							samples.resize(sample_pos);
 
-						std::vector<std::vector<float>> ncdata;	//Non-cradle data samples for post-inference
+							std::vector<std::vector<float>> ncdata;	//Non-cradle data samples for post-inference
 
-						//Normalize the data & choose reference non-cradle data set
-						if (samples.size() != 0){
-							if (sample_type[mod_sel] == CradleFunctions::HORIZONTAL_DIR){
-								normalizeSamples(samples, mean_h, var_h);
-								ncdata = sample_select[0];
-							}
-							else if (sample_type[mod_sel] == CradleFunctions::VERTICAL_DIR){
-								normalizeSamples(samples, mean_v, var_v);
-								ncdata = sample_select[1];
-							}
-							else{
-								//Cross section
+							//Normalize the data & choose reference non-cradle data set
+							if (samples.size() != 0){
+								if (sample_type[mod_sel] == CradleFunctions::HORIZONTAL_DIR){
+									normalizeSamples(samples, mean_h, var_h);
+									ncdata = sample_select[0];
+								}
+								else if (sample_type[mod_sel] == CradleFunctions::VERTICAL_DIR){
+									normalizeSamples(samples, mean_v, var_v);
+									ncdata = sample_select[1];
+								}
+								else{
+									//Cross section
+								}
 							}
-						}
 
-						std::vector<std::vector<float>> diffs;
-						if (samples.size() != 0){
-							if (clustering){
-								//Convert samples to a cv::Mat
-								cv::Mat samples_mat(samples.size(), samples[0].size(), CV_32F);
-								for (int a = 0; a < samples.size(); a++){
-									for (int b = 0; b < samples[0].size(); b++){
-										samples_mat.at<float>(a, b) = samples[a][b];
+							std::vector<std::vector<float>> diffs;
+							if (samples.size() != 0){
+								if (clustering){
+									//Convert samples to a cv::Mat
+									cv::Mat samples_mat(samples.size(), samples[0].size(), CV_32F);
+									for (int a = 0; a < samples.size(); a++){
+										for (int b = 0; b < samples[0].size(); b++){
+											samples_mat.at<float>(a, b) = samples[a][b];
+										}
 									}
-								}
 
-								//Use clustering for separation
-								diffs = std::vector<std::vector<float>>(samples.size());
-								for (int i = 0; i < diffs.size(); i++){
-									diffs[i] = std::vector<float>(samples[i].size());
-								}
-
-								cv::Mat neighborsIdx; //This mat will contain the index of nearest neighbour as returned by Kd-tree
-								cv::Mat distances; //In this mat Kd-Tree return the distances for each nearest neighbour
+									//Use clustering for separation
+									diffs = std::vector<std::vector<float>>(samples.size());
+									for (int i = 0; i < diffs.size(); i++){
+										diffs[i] = std::vector<float>(samples[i].size());
+									}
 
-								//Initialize structures
-								neighborsIdx.create(cv::Size(NR_NEIGHBOURS, samples_mat.rows), CV_32SC1);
-								distances.create(cv::Size(NR_NEIGHBOURS, samples_mat.rows), CV_32FC1);
+									cv::Mat neighborsIdx; //This mat will contain the index of nearest neighbour as returned by the search
+									cv::Mat distances; //In this mat the search returns the (squared) distances for each nearest neighbour
 
-								//Run KD search
-								kdTree->knnSearch(samples_mat, neighborsIdx, distances, NR_NEIGHBOURS, cvflann::SearchParams(8));
+									//Run NN search on the codebook of the model
+									knnSearch(index, samples_mat, neighborsIdx, distances, NR_NEIGHBOURS);
 
-								for (int i = 0; i < samples.size(); i++){
-									//Get weights
-									std::vector<float> weights(NR_NEIGHBOURS);
-									float sumweight = 0;
-									for (int j = 0; j < NR_NEIGHBOURS; j++){
-										weights[j] = 1.0 / (1 + distances.at<float>(i, j));
-										sumweight += weights[j];
-									}
+									for (int i = 0; i < samples.size(); i++){
+										//Get weights
+										std::vector<float> weights(NR_NEIGHBOURS);
+										float sumweight = 0;
+										for (int j = 0; j < NR_NEIGHBOURS; j++){
+											weights[j] = 1.0 / (1 + distances.at<float>(i, j));
+											sumweight += weights[j];
+										}
 
-									//Get interpolated decomposition
-									for (int k = 0; k < NR_NEIGHBOURS; k++){
-										float cweight = weights[k] / sumweight;
-										for (int j = 0; j < samples[i].size(); j++){
-											diffs[i][j] += clusters_diffs[neighborsIdx.at<int>(i, k)][j] * cweight;
+										//Get interpolated decomposition
+										for (int k = 0; k < NR_NEIGHBOURS; k++){
+											float cweight = weights[k] / sumweight;
+											for (int j = 0; j < samples[i].size(); j++){
+												diffs[i][j] += codebook_diffs[neighborsIdx.at<int>(i, k)][j] * cweight;
+											}
 										}
 									}
 								}
+								else{
+									//Do the full post-inference
+									post_inference(model, samples, ncdata, diffs);
+								}
 							}
-							else{
-								//Do the full post-inference
-								post_inference(model, samples, ncdata, diffs);
-							}
-						}
 
-						//Unnormalize separation data
-						if (samples.size() != 0){
-							if (sample_type[mod_sel] == CradleFunctions::HORIZONTAL_DIR){
-								unNormalizeSamples(diffs, mean_h, var_h);
-							}
-							else if (sample_type[mod_sel] == CradleFunctions::VERTICAL_DIR){
-								unNormalizeSamples(diffs, mean_v, var_v);
-							}
-							else{
-								//Cross section
-								unNormalizeSamplesCrossSection(diffs, mean_h, var_h, mean_v, var_v);
+							//Unnormalize separation data
+							if (samples.size() != 0){
+								if (sample_type[mod_sel] == CradleFunctions::HORIZONTAL_DIR){
+									unNormalizeSamples(diffs, mean_h, var_h);
+								}
+								else if (sample_type[mod_sel] == CradleFunctions::VERTICAL_DIR){
+									unNormalizeSamples(diffs, mean_v, var_v);
+								}
+								else{
+									//Cross section
+									unNormalizeSamplesCrossSection(diffs, mean_h, var_h, mean_v, var_v);
+								}
 							}
-						}
 
-						//Reset index of sample_pos
-						sample_pos = 0;
+							//Reset index of sample_pos
+							sample_pos = 0;
 						
-						//Apply separation to the decomposition coefficients
-						for (int i = 0; i < ex - sx; i++){
-							for (int j = 0; j < ey - sy; j++) if ((mask.at<char>(i + sx, j + sy) & CradleFunctions::DEFECT) != CradleFunctions::DEFECT) {
-
-								int pi = piecemark.at<ushort>(i + sx, j + sy) + 1;	//Index of the piece
-								int coeff_size = target_dim;
+							//Apply separation to the decomposition coefficients
+							for (int i = 0; i < ex - sx; i++){
+								for (int j = 0; j < ey - sy; j++) {
+									const CradleIntervals::Run *run = paddedRun(runs, i + sx, j + sy);
+									if (run && (run->flags & CradleFunctions::DEFECT) == CradleFunctions::DEFECT)
+										continue;
+
+									int pi = (run ? run->id : 0) + 1;	//Index of the piece
+									int coeff_size = target_dim;
 								
-								if (pi > 1){
-									int ci;
-									bool partOfCradle = false;
-
-									if (mod_sel >= 2 + ms.pieceIDh.size()){
-										//It's a vertical cradle piece
-										ci = mod_sel - 2 - ms.pieceIDh.size();
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDv[ci].size(); temp++){
-											if (ms.pieceIDv[ci][temp] == pi - 1)
-												partOfCradle = true;
-										}
-
-										//Apply vertical separation
-										if (partOfCradle){
-											samples[sample_pos] = std::vector<float>(coeff_size);
+									if (pi > 1){
+										int ci;
+										bool partOfCradle = false;
+
+										if (mod_sel >= 2 + ms.pieceIDh.size()){
+											//It's a vertical cradle piece
+											ci = mod_sel - 2 - ms.pieceIDh.size();
+
+											//Check if segment is part of the cradle
+											for (int temp = 0; temp < ms.pieceIDv[ci].size(); temp++){
+												if (ms.pieceIDv[ci][temp] == pi - 1)
+													partOfCradle = true;
+											}
 
-											//Fill up sample - vertical
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_v[l] == 1){
-												coeffs[l].at<float>(i, j) -= diffs[sample_pos][lindex];
-												//coeffs[l].at<float>(i, j) = 0;
-												lindex++;
+											//Apply vertical separation
+											if (partOfCradle){
+												samples[sample_pos] = std::vector<float>(coeff_size);
+
+												//Fill up sample - vertical
+												int lindex = 0;
+												for (int l = 0; l < 61; l++) if (target_v[l] == 1){
+													coeffs[l].at<float>(i, j) -= diffs[sample_pos][lindex];
+													//coeffs[l].at<float>(i, j) = 0;
+													lindex++;
+												}
+												sample_pos++;
 											}
-											sample_pos++;
-										}
 
-									}
-									else{
-										//It's a horizontal cradle piece
-										ci = mod_sel - 2;
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDh[ci].size(); temp++){
-											if (ms.pieceIDh[ci][temp] == pi - 1)
-												partOfCradle = true;
 										}
+										else{
+											//It's a horizontal cradle piece
+											ci = mod_sel - 2;
+
+											//Check if segment is part of the cradle
+											for (int temp = 0; temp < ms.pieceIDh[ci].size(); temp++){
+												if (ms.pieceIDh[ci][temp] == pi - 1)
+													partOfCradle = true;
+											}
 
-										//Apply horizontal separation
-										if (partOfCradle){
-											samples[sample_pos] = std::vector<float>(coeff_size);
-
-											//Fill up sample - horizontal
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_h[l] == 1){
-												coeffs[l].at<float>(i, j) -= diffs[sample_pos][lindex];
-												//coeffs[l].at<float>(i, j) = 0;
-												lindex++;
+											//Apply horizontal separation
+											if (partOfCradle){
+												samples[sample_pos] = std::vector<float>(coeff_size);
+
+												//Fill up sample - horizontal
+												int lindex = 0;
+												for (int l = 0; l < 61; l++) if (target_h[l] == 1){
+													coeffs[l].at<float>(i, j) -= diffs[sample_pos][lindex];
+													//coeffs[l].at<float>(i, j) = 0;
+													lindex++;
+												}
+												sample_pos++;
 											}
-											sample_pos++;
 										}
 									}
 								}
 							}
-						}
 
-						//Reconstruct block
-						reconstructBlock(new_texture, coeffs, sx, sy, csx, csy, cex, cey);
+							//Reconstruct block
+							reconstructBlock(new_texture, coeffs, sx, sy, csx, csy, cex, cey);
+						}
 					}
+					new_texture.copyTo(texture);
+
+					//Drop the model, it is not needed any more
+					model = cradle_model_fitting();
 				}
-				new_texture.copyTo(texture);
 			}
 		}
 		if (!canceled)
@@ -761,11 +803,8 @@ namespace TextureRemoval{
 	}
 
 	void post_inference(cradle_model_fitting &model, std::vector<std::vector<float>> &c, std::vector<std::vector<float>> &nc, std::vector<std::vector<float>> &difference){
-		std::default_random_engine generator;
-
-		generator.seed(SEED);
 		int p = c[0].size();
-		int nsample = model.etac_v.size();
+		int nsample = model.Lambda_v.size();
 
 		int k1 = model.Lambda_v[0].cols;
 		int k2 = model.Gamma_v[0].cols;
@@ -952,14 +991,8 @@ namespace TextureRemoval{
 		}
 	}
 
-	cradle_model_fitting gibbsSampling(std::vector<std::vector<float>> &cradle, std::vector<std::vector<float>> &noncradle){
+	cradle_model_fitting gibbsSampling(std::vector<std::vector<float>> &cradle, std::vector<std::vector<float>> &noncradle, int storage, int piece){
 		//Initialize variables used
-		std::default_random_engine generator;
-		std::gamma_distribution<float> gamma_distr;
-		std::normal_distribution<float> normal_distr;
-		std::uniform_real_distribution<double> unif_distr(0.0, 1.0);
-
-		generator.seed(SEED);
 		int Ncradle = cradle.size();
 		int Nnoncradle = noncradle.size();
 
@@ -1020,19 +1053,18 @@ namespace TextureRemoval{
 		cv::Mat lambda(p, k1, CV_32F, cv::Scalar(0));	//Lambda = zeros(p,k1);
 
 		cv::Mat psijh1(p, k1, CV_32F);
-		gamma_distr = std::gamma_distribution<float>(df / 2, 2.0 / df);
 		for (int i = 0; i < p; i++){
+			Random::Stream rs = Random::stream(SEED, piece, 0, RS_INIT_PSIJH1, i);
 			for (int j = 0; j < k1; j++){
-				psijh1.at<float>(i, j) = gamma_distr(generator);
+				psijh1.at<float>(i, j) = Random::gamma(rs, df / 2, 2.0 / df);
 			}
 		}// psijh1 = gamrnd(df/2,2/df,[p,k1]); 
 		
 		std::vector<float> delta1(k1);
-		gamma_distr = std::gamma_distribution<float>(ad1, bd1);
-		delta1[0] = gamma_distr(generator);
-		gamma_distr = std::gamma_distribution<float>(ad2, bd2);
+		Random::Stream rsd = Random::stream(SEED, piece, 0, RS_INIT_DELTA1, 0);
+		delta1[0] = Random::gamma(rsd, ad1, bd1);
 		for (int i = 1; i < k1; i++){
-			delta1[i] = gamma_distr(generator);
+			delta1[i] = Random::gamma(rsd, ad2, bd2);
 		}// delta1 = [gamrnd(ad1, bd1); gamrnd(ad2, bd2, [k1 - 1, 1])];
 		
 		std::vector<float> tauh1(k1);
@@ -1053,19 +1085,18 @@ namespace TextureRemoval{
 		double rho = mrho;
 		cv::Mat Gamma(p, k2, CV_32F, cv::Scalar(0));
 		cv::Mat psijh2(p, k2, CV_32F);
-		gamma_distr = std::gamma_distribution<float>(df / 2, 2.0 / df);
 		for (int i = 0; i < p; i++){
+			Random::Stream rs = Random::stream(SEED, piece, 0, RS_INIT_PSIJH2, i);
 			for (int j = 0; j < k2; j++){
-				psijh2.at<float>(i, j) = gamma_distr(generator);
+				psijh2.at<float>(i, j) = Random::gamma(rs, df / 2, 2.0 / df);
 			}
 		}// psijh2 = gamrnd(df/2,2/df,[p,k2]);
 		
 		std::vector<float> delta2(k2);
-		gamma_distr = std::gamma_distribution<float>(ad1, bd1);
-		delta2[0] = gamma_distr(generator);
-		gamma_distr = std::gamma_distribution<float>(ad2, bd2);
+		rsd = Random::stream(SEED, piece, 0, RS_INIT_DELTA2, 0);
+		delta2[0] = Random::gamma(rsd, ad1, bd1);
 		for (int i = 1; i < k2; i++){
-			delta2[i] = gamma_distr(generator);
+			delta2[i] = Random::gamma(rsd, ad2, bd2);
 		}// delta2 = [gamrnd(Ad1, bd1); gamrnd(Ad2, bd2, [k2 - 1, 1])];
 		
 		std::vector<float> tauh2(k2);
@@ -1081,16 +1112,17 @@ namespace TextureRemoval{
 			}
 		}// Pgam = bsxfun(@times,psijh2,tauh2');
 
-		normal_distr = std::normal_distribution<float>(0, 1);
 		cv::Mat kappa(1, k2, CV_32F);
+		rsd = Random::stream(SEED, piece, 0, RS_INIT_KAPPA, 0);
 		for (int i = 0; i < k2; i++){
-			kappa.at<float>(0, i) = normal_distr(generator);
+			kappa.at<float>(0, i) = Random::normal(rsd, 0, 1);
 		}// kappa = normrnd(0,1,[1,k2]);
 		
 		cv::Mat xi(Ncradle, k2, CV_32F);
 		for (int i = 0; i < Ncradle; i++){
+			Random::Stream rs = Random::stream(SEED, piece, 0, RS_INIT_XI, i);
 			for (int j = 0; j < k2; j++){
-				xi.at<float>(i, j) = normal_distr(generator) + kappa.at<float>(0, j);
+				xi.at<float>(i, j) = Random::normal(rs, 0, 1) + kappa.at<float>(0, j);
 			}
 		}// xi = bsxfun(@plus, normrnd(0,1,[Ncradle,k2]),kappa);
 		
@@ -1112,11 +1144,14 @@ namespace TextureRemoval{
 		fitting.rho_v = std::vector<float>(nrun - burn);
 		fitting.kappa_v = std::vector<cv::Mat>(nrun - burn);
 		fitting.Gamma_v = std::vector<cv::Mat>(nrun - burn);
-		fitting.xi_v = std::vector<cv::Mat>(nrun - burn);
 		fitting.Lambda_v = std::vector<cv::Mat>(nrun - burn);
 		fitting.ps_v = std::vector<cv::Mat>(nrun - burn);
-		fitting.etac_v = std::vector<cv::Mat>(nrun - burn);
-		fitting.etanc_v = std::vector<cv::Mat>(nrun - burn);
+		if (storage == STORE_FULL){
+			//Latent factors are Ncradle x k and Nnoncradle x k1 per draw, only kept on request
+			fitting.xi_v = std::vector<cv::Mat>(nrun - burn);
+			fitting.etac_v = std::vector<cv::Mat>(nrun - burn);
+			fitting.etanc_v = std::vector<cv::Mat>(nrun - burn);
+		}
 
 		/*** Start Gibbs sampling ***/
 		for (int iter = 0; iter < nrun; iter++){
@@ -1147,10 +1182,10 @@ namespace TextureRemoval{
 
 			//Sample zero-mean unit-variance uniform distribution
 			eta_nctmp = cv::Mat(Meta.rows, Meta.cols, CV_32F);
-			normal_distr = std::normal_distribution<float>(0, 1);
 			for (int i = 0; i < eta_nctmp.rows; i++){
+				Random::Stream rs = Random::stream(SEED, piece, iter, RS_ETA_NC, i);
 				for (int j = 0; j < eta_nctmp.cols; j++){
-					eta_nctmp.at<float>(i, j) = normal_distr(generator);
+					eta_nctmp.at<float>(i, j) = Random::normal(rs, 0, 1);
 				}
 			}
 			
@@ -1175,10 +1210,10 @@ namespace TextureRemoval{
 
 			//Sample zero-mean unit-variance uniform distribution
 			eta_nctmp = cv::Mat(Meta.rows, Meta.cols, CV_32F);
-			normal_distr = std::normal_distribution<float>(0, 1);
 			for (int i = 0; i < eta_nctmp.rows; i++){
+				Random::Stream rs = Random::stream(SEED, piece, iter, RS_ETA_C, i);
 				for (int j = 0; j < eta_nctmp.cols; j++){
-					eta_nctmp.at<float>(i, j) = normal_distr(generator);
+					eta_nctmp.at<float>(i, j) = Random::normal(rs, 0, 1);
 				}
 			}
 			//eta_nctmp = TextureRemoval::readMatFromFile("C:/Users/localadmin/Documents/MATLAB/code/platypus_matlab/result/eta_c" + std::to_string(iter + 1) + ".txt", eta_nctmp.rows, eta_nctmp.cols);
@@ -1212,9 +1247,9 @@ namespace TextureRemoval{
 				cv::invert(L, Linv);
 
 				cv::Mat samples(k1, 1, CV_32F, cv::Scalar(0));
-				normal_distr = std::normal_distribution<float>(0, 1);
+				Random::Stream rs = Random::stream(SEED, piece, iter, RS_LAMBDA, i);
 				for (int j = 0; j < samples.rows; j++){
-					samples.at<float>(j, 0) = normal_distr(generator);
+					samples.at<float>(j, 0) = Random::normal(rs, 0, 1);
 				}
 				
 				cv::Mat mvndmat = Ltransinv * Linv * blam + Ltransinv * samples;
@@ -1228,12 +1263,12 @@ namespace TextureRemoval{
 			float dftmp;
 			dftmp = df / 2 + 0.5;
 			for (int i = 0; i < psijh1.rows; i++){
+				Random::Stream rs = Random::stream(SEED, piece, iter, RS_PSIJH1, i);
 				for (int j = 0; j < psijh1.cols; j++){
 					float tmp = lambda.at<float>(i, j);
 					tmp = 1.0 / (df / 2 + tmp*tmp*tauh1[j]);	//tmp = 1./(df/2 + bsxfun(@times,Lambda.^2,tauh1'))
 
-					gamma_distr = std::gamma_distribution<float>(dftmp, tmp);
-					psijh1.at<float>(i, j) = gamma_distr(generator);	//gamrnd(df/2 + 0.5,1./(df/2 + bsxfun(@times,Lambda.^2,tauh1')));
+					psijh1.at<float>(i, j) = Random::gamma(rs, dftmp, tmp);	//gamrnd(df/2 + 0.5,1./(df/2 + bsxfun(@times,Lambda.^2,tauh1')));
 				}
 			}//  psijh1 = gamrnd(df/2 + 0.5,1./(df/2 + bsxfun(@times,Lambda.^2,tauh1')));
 			
@@ -1263,8 +1298,8 @@ namespace TextureRemoval{
 			bd = bd1 + 0.5 * (1.0 / delta1[0]) * tmpmss;		//bd = bd1 + 0.5*(1/delta1(1))*sum(tauh1.*sum(mat)');
 
 			//Resample
-			gamma_distr = std::gamma_distribution<float>(ad, 1.0 / bd);
-			delta1[0] = gamma_distr(generator);	//delta1(1) = gamrnd(ad,1/bd);
+			rsd = Random::stream(SEED, piece, iter, RS_DELTA1, 0);
+			delta1[0] = Random::gamma(rsd, ad, 1.0 / bd);	//delta1(1) = gamrnd(ad,1/bd);
 			
 			//Update tauh1
 			tauh1[0] = delta1[0];
@@ -1283,8 +1318,7 @@ namespace TextureRemoval{
 				bd = bd1 + 0.5 * (1.0 / delta1[h - 1]) * tmpmss; //bd = bd2 + 0.5*(1/delta1(h))*sum(tauh1(h:end).*sum(mat(:,h:end))');
 
 				//Resample
-				gamma_distr = std::gamma_distribution<float>(ad, 1.0 / bd);
-				delta1[h - 1] = gamma_distr(generator);	//delta1(h) = gamrnd(ad,1/bd);
+				delta1[h - 1] = Random::gamma(rsd, ad, 1.0 / bd);	//delta1(h) = gamrnd(ad,1/bd);
 				
 				//Update tauh1
 				tauh1[0] = delta1[0];
@@ -1321,10 +1355,10 @@ namespace TextureRemoval{
 
 			//Sample multivariate normal distribution
 			cv::Mat samples(Mxi.rows, Mxi.cols, CV_32F);
-			normal_distr = std::normal_distribution<float>(0, 1);
 			for (int i = 0; i < samples.rows; i++){
+				Random::Stream rs = Random::stream(SEED, piece, iter, RS_XI, i);
 				for (int j = 0; j < samples.cols; j++){
-					samples.at<float>(i, j) = normal_distr(generator);
+					samples.at<float>(i, j) = Random::normal(rs, 0, 1);
 				}
 			}
 			//samples = TextureRemoval::readMatFromFile("C:/Users/localadmin/Documents/MATLAB/code/platypus_matlab/result/xi" + std::to_string(iter + 1) + ".txt", samples.rows, samples.cols);
@@ -1346,9 +1380,9 @@ namespace TextureRemoval{
 				xisum[j] /= Ncradle;
 			}//xisum = sum(xi,1)/Ncradle
 
+			rsd = Random::stream(SEED, piece, iter, RS_KAPPA, 0);
 			for (int i = 0; i < kappa.cols; i++){
-				normal_distr = std::normal_distribution<float>(xisum[i], 1.0 / Ncradle);
-				kappa.at<float>(0, i) = normal_distr(generator);
+				kappa.at<float>(0, i) = Random::normal(rsd, xisum[i], 1.0 / Ncradle);
 			}//kappa = arrayfun(@(x)normrnd(x,1/Ncradle,[1,1]),sum(xi,1)/Ncradle);
 			
 			/*** Update gamma ***/
@@ -1378,9 +1412,9 @@ namespace TextureRemoval{
 				cv::invert(L, Linv);
 
 				cv::Mat samples(k2, 1, CV_32F, cv::Scalar(0));
-				normal_distr = std::normal_distribution<float>(0, 1);
+				Random::Stream rs = Random::stream(SEED, piece, iter, RS_GAMMA, i);
 				for (int j = 0; j < samples.rows; j++){
-					samples.at<float>(j, 0) = normal_distr(generator);
+					samples.at<float>(j, 0) = Random::normal(rs, 0, 1);
 				}
 				//samples = TextureRemoval::readMatFromFile("C:/Users/localadmin/Documents/MATLAB/code/platypus_matlab/result/zlamG" + std::to_string(iter + 1) + "_" + std::to_string(i + 1) + ".txt", samples.rows, samples.cols);
 
@@ -1395,12 +1429,12 @@ namespace TextureRemoval{
 			/*** Update psi_{jh}'s ***/
 			dftmp = df / 2 + 0.5;
 			for (int i = 0; i < psijh2.rows; i++){
+				Random::Stream rs = Random::stream(SEED, piece, iter, RS_PSIJH2, i);
 				for (int j = 0; j < psijh2.cols; j++){
 					float tmp = Gamma.at<float>(i, j);
 					tmp = 1.0 / (df / 2 + tmp*tmp*tauh2[j]);	//tmp = 1./(df/2 + bsxfun(@times,Gamma.^2,tauh2'))
 
-					gamma_distr = std::gamma_distribution<float>(dftmp, tmp);
-					psijh2.at<float>(i, j) = gamma_distr(generator);	//gamrnd(df/2 + 0.5,1./(df/2 + bsxfun(@times,Gamma.^2,tauh2')));
+					psijh2.at<float>(i, j) = Random::gamma(rs, dftmp, tmp);	//gamrnd(df/2 + 0.5,1./(df/2 + bsxfun(@times,Gamma.^2,tauh2')));
 				}
 			}
 
@@ -1430,8 +1464,8 @@ namespace TextureRemoval{
 			bd = bd1 + 0.5 * (1.0 / delta2[0]) * tmpmss;		//bd = bd1 + .5*(1 / delta2(1))*sum(tauh2.*sum(mat)');
 
 			//Resample
-			gamma_distr = std::gamma_distribution<float>(ad, 1.0 / bd);
-			delta2[0] = gamma_distr(generator);	//delta2(1) = gamrnd(ad,1/bd);
+			rsd = Random::stream(SEED, piece, iter, RS_DELTA2, 0);
+			delta2[0] = Random::gamma(rsd, ad, 1.0 / bd);	//delta2(1) = gamrnd(ad,1/bd);
 			
 			//Update tauh2
 			tauh2[0] = delta2[0];
@@ -1450,8 +1484,7 @@ namespace TextureRemoval{
 				bd = bd1 + 0.5 * (1.0 / delta2[h - 1]) * tmpmss; //bd = bd2 + 0.5*(1/delta2(h))*sum(tauh2(h:end).*sum(mat(:,h:end))');
 
 				//Resample
-				gamma_distr = std::gamma_distribution<float>(ad, 1.0 / bd);
-				delta2[h - 1] = gamma_distr(generator);	//delta2(h) = gamrnd(ad,1/bd);
+				delta2[h - 1] = Random::gamma(rsd, ad, 1.0 / bd);	//delta2(h) = gamrnd(ad,1/bd);
 				
 				//Update tauh2
 				tauh2[0] = delta2[0];
@@ -1485,7 +1518,8 @@ namespace TextureRemoval{
 				
 				// make adaptations for non - cradle parameters
 				float prob = 1.0 / std::exp(b0 + b1*iter);
-				float uu = unif_distr(generator);
+				Random::Stream rsa = Random::stream(SEED, piece, iter, RS_ADAPT1, 0);
+				float uu = Random::uniform(rsa);
 
 				std::vector<float> lind(lambda.cols);
 				for (int i = 0; i < lambda.rows; i++){
@@ -1515,34 +1549,34 @@ namespace TextureRemoval{
 
 						//Extend eta_c
 						cv::Mat colextendc(eta_c.rows, 1, CV_32F);
-						normal_distr = std::normal_distribution<float>(0, 1);
 						for (int i = 0; i < colextendc.rows; i++){
-							colextendc.at<float>(i, 0) = normal_distr(generator);
+							Random::Stream rs = Random::stream(SEED, piece, iter, RS_EXPAND_ETA_C, i);
+							colextendc.at<float>(i, 0) = Random::normal(rs, 0, 1);
 						}
 						cv::hconcat(eta_c, colextendc, eta_c);
 						//eta(mask,k1) = normrnd(0,1,[ncradle,1]);
 
 						//Extend eta_nc
 						cv::Mat colextendnc(eta_nc.rows, 1, CV_32F);
-						normal_distr = std::normal_distribution<float>(0, 1);
 						for (int i = 0; i < colextendnc.rows; i++){
-							colextendnc.at<float>(i, 0) = normal_distr(generator);
+							Random::Stream rs = Random::stream(SEED, piece, iter, RS_EXPAND_ETA_NC, i);
+							colextendnc.at<float>(i, 0) = Random::normal(rs, 0, 1);
 						}
 						cv::hconcat(eta_nc, colextendnc, eta_nc);
 						//eta(~mask,k1) = normrnd(0,1,[nnoncradle,1]);
 
 						//Extend psijh1
 						cv::Mat colextend(p, 1, CV_32F);
-						gamma_distr = std::gamma_distribution<float>(df / 2, 2.0 / df);
 						for (int i = 0; i < p; i++){
-							colextend.at<float>(i, 0) = gamma_distr(generator);
+							Random::Stream rs = Random::stream(SEED, piece, iter, RS_EXPAND_PSIJH1, i);
+							colextend.at<float>(i, 0) = Random::gamma(rs, df / 2, 2.0 / df);
 						}
 						cv::hconcat(psijh1, colextend, psijh1);
 						// psijh1(:,k1) = gamrnd(df/2,2/df,[p,1]);
 
 						//Extend delta1
-						gamma_distr = std::gamma_distribution<float>(ad2, 1.0 / bd2);
-						delta1.push_back(gamma_distr(generator));
+						Random::Stream rs = Random::stream(SEED, piece, iter, RS_EXPAND_DELTA1, 0);
+						delta1.push_back(Random::gamma(rs, ad2, 1.0 / bd2));
 						//delta1 = [delta1;gamrnd(ad2,1/bd2)];
 
 						//Extend tauh1
@@ -1651,7 +1685,8 @@ namespace TextureRemoval{
 
 				// make adaptations for cradle parameters
 				prob = 1.0 / std::exp(b0 + b1*iter);
-				uu = unif_distr(generator);
+				rsa = Random::stream(SEED, piece, iter, RS_ADAPT2, 0);
+				uu = Random::uniform(rsa);
 
 				lind = std::vector<float>(Gamma.cols);
 				for (int i = 0; i < Gamma.rows; i++){
@@ -1679,32 +1714,32 @@ namespace TextureRemoval{
 
 						//Extend kappa
 						cv::Mat colextend(1, 1, CV_32F);
-						normal_distr = std::normal_distribution<float>(0, 1);
-						colextend.at<float>(0, 0) = normal_distr(generator);
+						Random::Stream rs = Random::stream(SEED, piece, iter, RS_EXPAND_KAPPA, 0);
+						colextend.at<float>(0, 0) = Random::normal(rs, 0, 1);
 						cv::hconcat(kappa, colextend, kappa);
 						// kappa(k2) = normrnd(0,1,[1,1]);
 
 						//Extend xi
 						colextend = cv::Mat(Ncradle, 1, CV_32F);
-						normal_distr = std::normal_distribution<float>(kappa.at<float>(0, k2 - 1), 1);
 						for (int i = 0; i < Ncradle; i++){
-							colextend.at<float>(i, 0) = normal_distr(generator);
+							rs = Random::stream(SEED, piece, iter, RS_EXPAND_XI, i);
+							colextend.at<float>(i, 0) = Random::normal(rs, kappa.at<float>(0, k2 - 1), 1);
 						}
 						cv::hconcat(xi, colextend, xi);
 						// xi(:,k2) = normrnd(kappa(k2),1,[Ncradle,1]);
 
 						//Extend psijh2
 						colextend = cv::Mat(p, 1, CV_32F);
-						gamma_distr = std::gamma_distribution<float>(df / 2, 2.0 / df);
 						for (int i = 0; i < p; i++){
-							colextend.at<float>(i, 0) = gamma_distr(generator);
+							rs = Random::stream(SEED, piece, iter, RS_EXPAND_PSIJH2, i);
+							colextend.at<float>(i, 0) = Random::gamma(rs, df / 2, 2.0 / df);
 						}
 						cv::hconcat(psijh2, colextend, psijh2);
 						// psijh2(:,k2) = gamrnd(df/2,2/df,[p,1]);
 
 						//Extend delta2
-						gamma_distr = std::gamma_distribution<float>(ad2, 1.0 / bd2);
-						delta2.push_back(gamma_distr(generator));
+						rs = Random::stream(SEED, piece, iter, RS_EXPAND_DELTA2, 0);
+						delta2.push_back(Random::gamma(rs, ad2, 1.0 / bd2));
 						//delta2 = [delta2;gamrnd(ad2,1/bd2)];
 
 						//Extend tauh1
@@ -1819,11 +1854,13 @@ namespace TextureRemoval{
 				fitting.rho_v[iter - burn] = rho;
 				fitting.kappa_v[iter - burn] = kappa.clone();
 				fitting.Gamma_v[iter - burn] = Gamma.clone();
-				fitting.xi_v[iter - burn] = xi.clone();
 				fitting.Lambda_v[iter - burn] = lambda.clone();
 				fitting.ps_v[iter - burn] = ps.clone();
-				fitting.etac_v[iter - burn] = eta_c.clone();
-				fitting.etanc_v[iter - burn] = eta_nc.clone();
+				if (storage == STORE_FULL){
+					fitting.xi_v[iter - burn] = xi.clone();
+					fitting.etac_v[iter - burn] = eta_c.clone();
+					fitting.etanc_v[iter - burn] = eta_nc.clone();
+				}
 			}
 		}
 
@@ -1912,7 +1949,7 @@ namespace TextureRemoval{
 		}
 	}
 
-	void sampleDataset(std::vector<std::vector<float>> &dts, std::vector<std::vector<float>> &samples, int cnt){
+	void sampleDataset(std::vector<std::vector<float>> &dts, std::vector<std::vector<float>> &samples, int cnt, int piece){
 		//Check if empty
 		if (dts.size() == 0){
 			samples = std::vector<std::vector<float>>(0);
@@ -1937,8 +1974,9 @@ namespace TextureRemoval{
 		samples = std::vector<std::vector<float>>(cnt);
 
 		//Sample cnt samples from specified dataset
+		Random::Stream rs = Random::stream(SEED, piece, 0, RS_SUBSAMPLE, 0);
 		for (int i = 0; i < cnt; i++){
-			int ind = std::rand() % maxind;
+			int ind = Random::uniformInt(rs, maxind);
 
 			//Copy picked index
 			samples[i] = std::vector<float>(s);
@@ -1948,6 +1986,53 @@ namespace TextureRemoval{
 		}
 	}
 
+	SampleReservoir createReservoir(int capacity, int dim, int piece){
+		SampleReservoir r;
+		r.capacity = capacity;
+		r.dim = dim;
+		r.seen = 0;
+		r.rs = Random::stream(SEED, piece, 0, RS_SUBSAMPLE, 0);
+		return r;
+	}
+
+	std::vector<float> *reserveSample(SampleReservoir &r){
+		r.seen++;
+
+		//Keep everything until the reservoir is full
+		if (r.samples.size() < r.capacity){
+			r.samples.push_back(std::vector<float>(r.dim));
+			return &r.samples.back();
+		}
+
+		//Afterwards the n-th sample replaces a random element with probability capacity/n (Algorithm R)
+		int ind = Random::uniformInt(r.rs, r.seen);
+		if (ind < r.capacity)
+			return &r.samples[ind];
+		return NULL;
+	}
+
+	void buildNeighbourIndex(NeighbourIndex &index, cv::Mat &codebook, int method){
+		index.codebook = codebook;
+		index.method = method;
+		index.kdTree.reset();
+
+		if (method == NN_KDTREE){
+			index.kdTree.reset(new cv::flann::GenericIndex< cvflann::L2<float> >(index.codebook, cvflann::KDTreeIndexParams(4)));
+		}
+	}
+
+	void knnSearch(NeighbourIndex &index, cv::Mat &queries, cv::Mat &indices, cv::Mat &distances, int k){
+		if (index.method == NN_KDTREE){
+			indices.create(cv::Size(k, queries.rows), CV_32SC1);
+			distances.create(cv::Size(k, queries.rows), CV_32FC1);
+			index.kdTree->knnSearch(queries, indices, distances, k, cvflann::SearchParams(8));
+		}
+		else{
+			//Exact search, squared L2 distances as returned by the kd-tree
+			cv::batchDistance(queries, index.codebook, distances, CV_32F, indices, cv::NORM_L2SQR, k);
+		}
+	}
+
 	void reconstructBlock(cv::Mat &texture, std::vector<cv::Mat> &coeffs, int sx, int sy, int csx, int csy, int cex, int cey){
 
 		cv::Mat img;